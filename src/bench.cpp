@@ -0,0 +1,250 @@
+/* Text Editor - benchmark harness
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Drives the editor's hot paths - load_file, the highlight pass and
+ * per-keystroke cursor movement plus rendering - against generated
+ * corpora and reports throughput and p50/p99 latency.  Build and run
+ * with `make bench'; pass --large to include the 1 GB corpora.
+ */
+
+#define TTE_BENCH
+#include "tte.cpp"
+
+#define BENCH_KEYSTROKES 2000
+
+
+static int
+compare_r64 (const void *a, const void *b)
+{
+  r64 diff = *(const r64 *) a - *(const r64 *) b;
+  return (diff > 0) - (diff < 0);
+}
+
+
+// C-looking text: identifiers, numbers, strings and both comment kinds.
+static void
+generate_many_lines (const char *path, size_t target_size)
+{
+  FILE *file = fopen (path, "w");
+  assert (file);
+
+  size_t written = 0;
+  u64 n = 0;
+
+  while (written < target_size)
+    {
+      int line_written;
+
+      switch (n % 5)
+        {
+        case 0:
+          line_written = fprintf (file, "int value%lu = %lu;\n", n, n * 7);
+          break;
+        case 1:
+          line_written = fprintf (file, "// comment line %lu\n", n);
+          break;
+        case 2:
+          line_written = fprintf (file, "char *name%lu = \"string %lu\";\n",
+                                  n, n);
+          break;
+        case 3:
+          line_written = fprintf (file, "/* block comment %lu */\n", n);
+          break;
+        default:
+          line_written = fprintf (file, "value%lu = (value%lu * 13);\n",
+                                  n, n / 2);
+          break;
+        }
+
+      assert (line_written > 0);
+      written += line_written;
+      ++n;
+    }
+
+  fclose (file);
+}
+
+
+// One giant line - the worst case for anything that scans per line.
+static void
+generate_long_line (const char *path, size_t target_size)
+{
+  FILE *file = fopen (path, "w");
+  assert (file);
+
+  size_t written = 0;
+  u64 n = 0;
+
+  while (written + 1 < target_size)
+    {
+      int chunk_written = fprintf (file, "x%lu = %lu, ", n, n * 3);
+      assert (chunk_written > 0);
+      written += chunk_written;
+      ++n;
+    }
+
+  fputc ('\n', file);
+  fclose (file);
+}
+
+
+// Regenerating 100 MB per run is slow - reuse a matching corpus.
+static void
+generate_corpus (const char *path, size_t target_size, int long_line)
+{
+  struct stat file_stat;
+  if (!stat (path, &file_stat) &&
+      (size_t) file_stat.st_size >= target_size &&
+      (size_t) file_stat.st_size < target_size + 4096)
+    {
+      return;
+    }
+
+  if (long_line) generate_long_line (path, target_size);
+  else           generate_many_lines (path, target_size);
+}
+
+
+static void
+bench_file (const char *label, const char *path)
+{
+  r64 t0 = now_seconds ();
+  Buffer buffer = load_file (path);
+  r64 t1 = now_seconds ();
+
+  size_t bytes = buffer.used;
+
+  Arena document_arena = new_arena (1u << 16);
+  LineIndex line_index = new_line_index (&document_arena);
+  line_index_rebuild (&line_index, &buffer);
+  HighlightState highlight = new_highlight_state (&document_arena);
+  highlight_rebuild (&highlight, &buffer, &line_index);
+  r64 t2 = now_seconds ();
+
+  // Keystroke loop: DOWN through the file, rendering into an
+  // in-memory screen flushed to /dev/null, re-rendering content only
+  // when the viewport scrolled - the same work an interactive
+  // keypress costs.
+  int null_fd = open ("/dev/null", O_WRONLY);
+  assert (null_fd != -1);
+  OutputBuffer out = new_output_buffer (null_fd, 64 * 1024);
+
+  Screen screen = new_screen ();
+  screen_resize (&screen, 60, 200);
+
+  Viewport viewport;
+  viewport.top_line = 0;
+  viewport.left_col = 0;
+  viewport.rows = 59;
+  viewport.cols = 200;
+
+  render_viewport (&viewport, &buffer, &line_index, &highlight, &screen);
+  screen_flush (&screen, &out);
+  out_flush (&out);
+
+  static r64 latencies[BENCH_KEYSTROKES];
+  size_t y = 0;
+
+  for (int i = 0; i < BENCH_KEYSTROKES; ++i)
+    {
+      r64 start = now_seconds ();
+
+      size_t line = line_index_find (&line_index, y);
+      if (line + 1 < line_index.count) y = line_index.offsets[line + 1];
+      else                             y = 0;
+
+      size_t cursor_line = line_index_find (&line_index, y);
+      b8 scrolled = 0;
+      if (cursor_line < viewport.top_line)
+        {
+          viewport.top_line = cursor_line;
+          scrolled = 1;
+        }
+      else if (cursor_line >= viewport.top_line + viewport.rows)
+        {
+          viewport.top_line = cursor_line - viewport.rows + 1;
+          scrolled = 1;
+        }
+
+      if (scrolled)
+        {
+          render_viewport (&viewport, &buffer, &line_index, &highlight,
+                           &screen);
+        }
+
+      screen_flush (&screen, &out);
+      out_flush (&out);
+
+      latencies[i] = now_seconds () - start;
+    }
+
+  qsort (latencies, BENCH_KEYSTROKES, sizeof (r64), compare_r64);
+  r64 p50 = latencies[BENCH_KEYSTROKES / 2];
+  r64 p99 = latencies[BENCH_KEYSTROKES * 99 / 100];
+
+  printf ("%-18s %8.1f MB  load %8.1f MB/s  highlight %8.1f MB/s  "
+          "keystroke p50 %7.1f us  p99 %7.1f us\n",
+          label,
+          bytes / 1e6,
+          bytes / 1e6 / (t1 - t0),
+          bytes / 1e6 / (t2 - t1),
+          p50 * 1e6,
+          p99 * 1e6);
+
+  free (screen.front);
+  free (screen.back);
+  free (out.buffer.data);
+  close (null_fd);
+  arena_free (&document_arena);
+  buffer_free (&buffer);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  int large = argc > 1 && !strcmp (argv[1], "--large");
+
+  const char *tmp = getenv ("TMPDIR");
+  if (!tmp) tmp = "/tmp";
+
+  struct {
+    const char *label;
+    size_t size;
+    int long_line;
+  } corpora[] = {
+    {"1M-many-lines",    1u << 20,   0},
+    {"1M-long-line",     1u << 20,   1},
+    {"100M-many-lines",  100u << 20, 0},
+    {"100M-long-line",   100u << 20, 1},
+    {"1G-many-lines",    1u << 30,   0},
+    {"1G-long-line",     1u << 30,   1},
+  };
+
+  size_t count = large ? 6 : 4;
+
+  for (size_t i = 0; i < count; ++i)
+    {
+      char path[512];
+      sprintf (path, "%s/tte_bench_%s.c", tmp, corpora[i].label);
+      generate_corpus (path, corpora[i].size, corpora[i].long_line);
+      bench_file (corpora[i].label, path);
+    }
+
+  return 0;
+}
@@ -0,0 +1,361 @@
+/* Text Editor - performance regression gate
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Drives the hot paths against corpora synthesized for this
+ * codebase's weak spots - one giant line, nested block comments and
+ * unterminated strings, megabytes of leading whitespace, binary-ish
+ * data - and compares throughput against a locally recorded baseline.
+ *
+ *   make perf-baseline   records perf_baseline.txt on the clean tree
+ *   make perf-regress    fails if any metric drops more than 5%
+ *
+ * Each metric takes the best of a few repeats, so scheduler noise has
+ * to be sustained to show up.  The baseline is machine-specific and
+ * not meant to be committed.
+ */
+
+#define TTE_BENCH
+#include "tte.cpp"
+
+#define PERF_CORPUS_SIZE (32u << 20)
+#define PERF_REPEATS 5
+#define PERF_TOLERANCE 0.95
+
+#define PERF_METRIC_MAX 16
+
+struct PerfMetric {
+  char name[64];
+  r64 value;          // MB/s - higher is better
+};
+
+
+// One line of PERF_CORPUS_SIZE bytes - nothing for per-line logic to
+// bite on until the very end.
+static void
+generate_one_line (FILE *file)
+{
+  size_t written = 0;
+  u64 n = 0;
+
+  while (written + 1 < PERF_CORPUS_SIZE)
+    {
+      int chunk = fprintf (file, "w%lu = (w%lu * 31); ", n, n + 1);
+      assert (chunk > 0);
+      written += chunk;
+      ++n;
+    }
+
+  fputc ('\n', file);
+}
+
+
+// Deeply nested comment openers and unterminated strings - every line
+// flips the parser context the next line inherits.
+static void
+generate_comment_soup (FILE *file)
+{
+  size_t written = 0;
+  u64 n = 0;
+
+  while (written < PERF_CORPUS_SIZE)
+    {
+      int chunk;
+
+      switch (n % 4)
+        {
+        case 0:
+          chunk = fprintf (file, "/* /* /* nested opener %lu\n", n);
+          break;
+        case 1:
+          chunk = fprintf (file, "still in comment %lu */ code%lu();\n",
+                           n, n);
+          break;
+        case 2:
+          chunk = fprintf (file, "char *s%lu = \"unterminated %lu\n", n, n);
+          break;
+        default:
+          chunk = fprintf (file, "closes here\"; /* and opens again\n");
+          break;
+        }
+
+      assert (chunk > 0);
+      written += chunk;
+      ++n;
+    }
+}
+
+
+// Megabytes of leading whitespace in front of short statements.
+static void
+generate_whitespace (FILE *file)
+{
+  static const char pad[] = "                                "
+                            "\t\t\t\t                        ";
+  size_t written = 0;
+  u64 n = 0;
+
+  while (written < PERF_CORPUS_SIZE)
+    {
+      for (int i = 0; i < 16; ++i)
+        {
+          fputs (pad, file);
+          written += sizeof (pad) - 1;
+        }
+
+      int chunk = fprintf (file, "x%lu = %lu;\n", n, n);
+      assert (chunk > 0);
+      written += chunk;
+      ++n;
+    }
+}
+
+
+// Deterministic byte soup (no NULs) for the paint-as-is path.
+static void
+generate_binaryish (FILE *file)
+{
+  u32 state = 0x12345678;
+
+  for (size_t i = 0; i < PERF_CORPUS_SIZE; ++i)
+    {
+      state = state * 1664525u + 1013904223u;
+      u8 byte = state >> 24;
+      if (byte == 0) byte = 0xff;
+      if (i % 4096 == 4095) byte = '\n';
+      fputc (byte, file);
+    }
+}
+
+
+static void
+generate_corpus (const char *path, void (*generate) (FILE *))
+{
+  struct stat file_stat;
+  if (!stat (path, &file_stat) &&
+      (size_t) file_stat.st_size >= PERF_CORPUS_SIZE &&
+      (size_t) file_stat.st_size < PERF_CORPUS_SIZE + 4096)
+    {
+      return;
+    }
+
+  FILE *file = fopen (path, "w");
+  assert (file);
+  generate (file);
+  fclose (file);
+}
+
+
+// Line-index and highlight throughput for one corpus, best of
+// PERF_REPEATS.  Raw load is mmap and takes microseconds regardless
+// of file size, so it is all timer noise - these two passes touch
+// every byte and give repeatable numbers.
+static void
+measure (const char *label, const char *path,
+         PerfMetric *metrics, size_t *metric_count)
+{
+  r64 best_index = 0;
+  r64 best_highlight = 0;
+  size_t bytes = 0;
+
+  for (int repeat = 0; repeat < PERF_REPEATS; ++repeat)
+    {
+      Buffer buffer = load_file (path);
+
+      Arena arena = new_arena (1u << 16);
+      LineIndex line_index = new_line_index (&arena);
+      r64 t0 = now_seconds ();
+      line_index_rebuild (&line_index, &buffer);
+      r64 t1 = now_seconds ();
+      HighlightState highlight = new_highlight_state (&arena);
+      highlight_rebuild (&highlight, &buffer, &line_index);
+      r64 t2 = now_seconds ();
+
+      bytes = buffer.used;
+      r64 index = bytes / 1e6 / (t1 - t0);
+      r64 hl = bytes / 1e6 / (t2 - t1);
+      if (index > best_index) best_index = index;
+      if (hl > best_highlight) best_highlight = hl;
+
+      arena_free (&arena);
+      buffer_free (&buffer);
+    }
+
+  PerfMetric *metric = &metrics[(*metric_count)++];
+  sprintf (metric->name, "%s-index", label);
+  metric->value = best_index;
+
+  metric = &metrics[(*metric_count)++];
+  sprintf (metric->name, "%s-highlight", label);
+  metric->value = best_highlight;
+
+  printf ("%-24s %6.1f MB  index %8.1f MB/s  highlight %8.1f MB/s\n",
+          label, bytes / 1e6, best_index, best_highlight);
+}
+
+
+static size_t
+read_baseline (const char *path, PerfMetric *metrics)
+{
+  FILE *file = fopen (path, "r");
+  if (!file) return 0;
+
+  size_t count = 0;
+  while (count < PERF_METRIC_MAX &&
+         fscanf (file, "%63s %lf", metrics[count].name,
+                 &metrics[count].value) == 2)
+    {
+      ++count;
+    }
+
+  fclose (file);
+  return count;
+}
+
+
+int
+main (int argc, char **argv)
+{
+  int record = argc > 2 && !strcmp (argv[1], "--record");
+  int check = argc > 2 && !strcmp (argv[1], "--check");
+
+  if (!record && !check)
+    {
+      fprintf (stderr, "usage: %s --record|--check <baseline-file>\n",
+               argv[0]);
+      return 1;
+    }
+
+  const char *baseline_path = argv[2];
+
+  const char *tmp = getenv ("TMPDIR");
+  if (!tmp) tmp = "/tmp";
+
+  struct {
+    const char *label;
+    void (*generate) (FILE *);
+  } corpora[] = {
+    {"one-line",     generate_one_line},
+    {"comment-soup", generate_comment_soup},
+    {"whitespace",   generate_whitespace},
+    {"binaryish",    generate_binaryish},
+  };
+
+  PerfMetric metrics[PERF_METRIC_MAX];
+  size_t metric_count = 0;
+
+  for (size_t i = 0; i < sizeof (corpora) / sizeof (*corpora); ++i)
+    {
+      char path[512];
+      sprintf (path, "%s/tte_perf_%s", tmp, corpora[i].label);
+      generate_corpus (path, corpora[i].generate);
+      measure (corpora[i].label, path, metrics, &metric_count);
+    }
+
+  if (record)
+    {
+      FILE *file = fopen (baseline_path, "w");
+      assert (file);
+      for (size_t i = 0; i < metric_count; ++i)
+        {
+          fprintf (file, "%s %f\n", metrics[i].name, metrics[i].value);
+        }
+      fclose (file);
+      printf ("recorded %lu metrics to %s\n", metric_count, baseline_path);
+      return 0;
+    }
+
+  PerfMetric baseline[PERF_METRIC_MAX];
+  size_t baseline_count = read_baseline (baseline_path, baseline);
+
+  if (!baseline_count)
+    {
+      fprintf (stderr, "no baseline at %s - run `make perf-baseline' "
+               "on a known-good tree first\n", baseline_path);
+      return 1;
+    }
+
+  // A single pass can dip well below the real rate when the machine
+  // is busy; a genuine regression survives re-measurement.  Retry the
+  // whole suite a couple of times, keeping the best value per metric,
+  // and only fail on dips that persist.
+  int failed;
+
+  for (int attempt = 0; ; ++attempt)
+    {
+      failed = 0;
+
+      for (size_t i = 0; i < metric_count; ++i)
+        {
+          for (size_t j = 0; j < baseline_count; ++j)
+            {
+              if (strcmp (metrics[i].name, baseline[j].name)) continue;
+              if (metrics[i].value < baseline[j].value * PERF_TOLERANCE)
+                {
+                  failed = 1;
+                }
+            }
+        }
+
+      if (!failed || attempt == 2) break;
+
+      printf ("below baseline - re-measuring\n");
+
+      PerfMetric retry[PERF_METRIC_MAX];
+      size_t retry_count = 0;
+
+      for (size_t i = 0; i < sizeof (corpora) / sizeof (*corpora); ++i)
+        {
+          char path[512];
+          sprintf (path, "%s/tte_perf_%s", tmp, corpora[i].label);
+          measure (corpora[i].label, path, retry, &retry_count);
+        }
+
+      for (size_t i = 0; i < metric_count; ++i)
+        {
+          if (metrics[i].value < retry[i].value)
+            {
+              metrics[i].value = retry[i].value;
+            }
+        }
+    }
+
+  if (failed)
+    {
+      for (size_t i = 0; i < metric_count; ++i)
+        {
+          for (size_t j = 0; j < baseline_count; ++j)
+            {
+              if (strcmp (metrics[i].name, baseline[j].name)) continue;
+              if (metrics[i].value < baseline[j].value * PERF_TOLERANCE)
+                {
+                  printf ("FAIL %-24s %8.1f MB/s vs baseline %8.1f MB/s "
+                          "(%.1f%%)\n",
+                          metrics[i].name, metrics[i].value,
+                          baseline[j].value,
+                          100 * metrics[i].value / baseline[j].value);
+                }
+            }
+        }
+
+      return 1;
+    }
+
+  printf ("all %lu metrics within %d%% of baseline\n",
+          metric_count, (int) (100 * (1 - PERF_TOLERANCE)));
+  return 0;
+}
@@ -21,6 +21,11 @@
 #include <termios.h>    // tcgetattr, tcsetattr
 #include <sys/stat.h>   // stat, fstat
 #include <sys/ioctl.h>  // ioctl
+#include <sys/inotify.h> // inotify_init1, inotify_add_watch
+#include <sys/mman.h>   // mmap, munmap, madvise
+#include <poll.h>       // poll
+#include <pthread.h>    // pthread_create, pthread_join
+#include <time.h>        // clock_gettime
 
 // Windows alternative to termios.n should be conio.h
 
@@ -48,12 +53,26 @@ typedef int64_t s64;
 
 #define STR(string) (string), (sizeof (string) - 1)
 
+/* Gap buffer.  The text occupies data[0..gap_start) and
+ * data[gap_start + gap..size) where gap = size - used, so an insert or
+ * delete at the gap is O(1) amortized and moving the cursor only pays
+ * for the distance the gap travels.  While the gap sits at the end
+ * (gap_start == used, e.g. right after load_file) the whole text is
+ * contiguous at data[0..used).
+ */
 struct Buffer {
   char *data;
-  size_t used;
-  size_t size;
+  size_t used;       // Bytes of text stored (the gap excluded)
+  size_t size;       // Bytes allocated
+  size_t gap_start;  // Text offset the gap sits at
+  u64 generation;    // Bumped by every edit - lets derived data notice
+  b8 mapped;         // data is an mmap'd view of the file, not malloc'd
 };
 
+// Files at least this big are mmap'd instead of read into malloc'd
+// memory, so opening doesn't commit resident memory for the whole file.
+#define MMAP_LOAD_THRESHOLD (1u << 20)
+
 
 static Buffer
 new_buffer (size_t size)
@@ -62,513 +81,5316 @@ new_buffer (size_t size)
   buffer.data = (char *) malloc (size);
   buffer.used = 0;
   buffer.size = size;
+  buffer.gap_start = 0;
+  buffer.generation = 0;
+  buffer.mapped = 0;
   return buffer;
 }
 
-enum TextContextType {
-  TEXT_CONTEXT_GLOBAL,
-  TEXT_CONTEXT_BLOCK_COMMENT,
-  TEXT_CONTEXT_INLINE_COMMENT,
-  TEXT_CONTEXT_STRING_LITERAL,
-  TEXT_CONTEXT_CHAR_LITERAL,
-};
-
-struct TextContext {
-  TextContextType type;
-  size_t length;
-};
-
 
-static int
-is_latin (char c)
+static void
+buffer_free (Buffer *buffer)
 {
-  return ((c >= 'A' && c <= 'Z') ||
-          (c >= 'a' && c <= 'z'));
+  if (buffer->mapped)
+    {
+      munmap (buffer->data, buffer->size);
+    }
+  else
+    {
+      free (buffer->data);
+    }
+
+  buffer->data = 0;
+  buffer->used = 0;
+  buffer->size = 0;
+  buffer->gap_start = 0;
+  buffer->mapped = 0;
 }
 
 
-static int
-is_digit (char c)
+static char
+buffer_char_at (Buffer *buffer, size_t offset)
 {
-  return (c >= '0' && c <= '9');
+  assert (offset < buffer->used);
+
+  if (offset < buffer->gap_start)
+    {
+      return buffer->data[offset];
+    }
+
+  return buffer->data[offset + (buffer->size - buffer->used)];
 }
 
 
+/* Returns the longest contiguous run of text starting at offset and
+ * stores its length in *span_length.  A caller iterating the whole
+ * buffer sees at most two spans: before and after the gap.
+ */
 static char *
-parse_space (char *p)
+buffer_span (Buffer *buffer, size_t offset, size_t *span_length)
 {
-  while (*p == ' ' ||
-         *p == '\n' ||
-         *p == '\r' ||
-         *p == '\t')
+  assert (offset <= buffer->used);
+
+  if (offset < buffer->gap_start)
     {
-      write (1, p++, 1);
+      *span_length = buffer->gap_start - offset;
+      return buffer->data + offset;
     }
 
-  return p;
+  *span_length = buffer->used - offset;
+  return buffer->data + offset + (buffer->size - buffer->used);
 }
 
 
-static char *
-parse_block_comment (char *p)
+/* Hints the kernel to fault [offset, offset + length) in ahead of
+ * use.  Only meaningful for mmap'd buffers: a jump deep into a cold
+ * multi-gigabyte file otherwise pays a page fault per rendered line
+ * on the first paint.
+ */
+static void
+buffer_readahead (Buffer *buffer, size_t offset, size_t length)
 {
-  while (*p)
-    {
-      if (p[0] == '*' && p[1] == '/')
-        {
-          write (1, p, 2);
-          p += 2;
-          break;
-        }
-      else
-        {
-          write (1, p++, 1);
-        }
-    }
+  if (!buffer->mapped) return;
 
-  return p;
+  size_t page_size = sysconf (_SC_PAGESIZE);
+  size_t begin = offset & ~(page_size - 1);
+  size_t end = offset + length;
+  if (end > buffer->size) end = buffer->size;
+  if (begin >= end) return;
+
+  madvise (buffer->data + begin, end - begin, MADV_WILLNEED);
 }
 
 
-static char *
-parse_inline_comment (char *p)
+/* Copies an mmap'd buffer into owned memory and drops the file
+ * backing.  The mapping never has a gap (gap_start == used), so the
+ * text is one contiguous run.
+ */
+static void
+buffer_own (Buffer *buffer)
 {
-  while (*p &&
-         *p != '\n' &&
-         *p != '\r')
-    {
-      write (1, p++, 1);
-    }
+  if (!buffer->mapped) return;
 
-  return p;
+  char *data = (char *) malloc (buffer->size);
+  assert (data);
+  memcpy (data, buffer->data, buffer->used);
+  munmap (buffer->data, buffer->size);
+  buffer->data = data;
+  buffer->mapped = 0;
 }
 
 
-static char *
-parse_string_literal (char *p)
+static void
+buffer_move_gap (Buffer *buffer, size_t offset)
 {
-  while (*p)
+  assert (offset <= buffer->used);
+
+  size_t gap = buffer->size - buffer->used;
+
+  if (offset < buffer->gap_start)
     {
-      if (p[0] == '"' && p[-1] != '\\')
-        {
-          write (1, p++, 1);
-          break;
-        }
-      else
-        {
-          write (1, p++, 1);
-        }
+      memmove (buffer->data + offset + gap,
+               buffer->data + offset,
+               buffer->gap_start - offset);
+    }
+  else if (offset > buffer->gap_start)
+    {
+      memmove (buffer->data + buffer->gap_start,
+               buffer->data + buffer->gap_start + gap,
+               offset - buffer->gap_start);
     }
 
-  return p;
+  buffer->gap_start = offset;
 }
 
 
-static char *
-parse_identifier (char *p)
+static void
+buffer_reserve (Buffer *buffer, size_t length)
 {
-  while (is_latin (p[0]))
+  if (buffer->used + length <= buffer->size) return;
+
+  size_t new_size = buffer->size ? buffer->size : 64;
+  while (buffer->used + length > new_size)
     {
-      write (1, p++, 1);
+      new_size *= 2;
     }
 
-  return p;
+  if (buffer->mapped)
+    {
+      // First edit of an mmap'd buffer: copy it into owned memory so
+      // the realloc/free paths work.  The mapping has no gap
+      // (gap_start == used), so the text is one contiguous run.
+      char *data = (char *) malloc (new_size);
+      assert (data);
+      memcpy (data, buffer->data, buffer->used);
+      munmap (buffer->data, buffer->size);
+      buffer->data = data;
+      buffer->size = new_size;
+      buffer->mapped = 0;
+      return;
+    }
+
+  // Keep the gap at its offset: realloc, then shift the tail so the
+  // grown region extends the gap.
+  buffer->data = (char *) realloc (buffer->data, new_size);
+  assert (buffer->data);
+
+  size_t tail = buffer->used - buffer->gap_start;
+  memmove (buffer->data + new_size - tail,
+           buffer->data + buffer->size - tail,
+           tail);
+  buffer->size = new_size;
 }
 
 
-static char *
-parse_num (char *p)
+static void
+buffer_insert_at (Buffer *buffer, size_t offset, const char *data, size_t length)
+{
+  buffer_reserve (buffer, length);
+  buffer_move_gap (buffer, offset);
+  memcpy (buffer->data + buffer->gap_start, data, length);
+  buffer->gap_start += length;
+  buffer->used += length;
+  ++buffer->generation;
+}
+
+
+static void
+buffer_delete_range (Buffer *buffer, size_t offset, size_t length)
+{
+  assert (offset + length <= buffer->used);
+
+  // Deleting at the gap just widens it.
+  buffer_move_gap (buffer, offset);
+  buffer->used -= length;
+  ++buffer->generation;
+}
+
+
+/* Bump allocator.  An allocation is a pointer bump into the current
+ * chunk, a new chunk is chained in when it runs out, and nothing is
+ * freed individually: a document-lifetime arena is torn down in one
+ * arena_free, a per-frame scratch arena is recycled with arena_reset
+ * every main loop iteration.  Hot paths never touch malloc and
+ * frame-temporary memory can't fragment the heap over long sessions.
+ */
+struct ArenaChunk {
+  ArenaChunk *next;
+  size_t used;
+  size_t size;
+};
+
+struct Arena {
+  ArenaChunk *chunks;
+  size_t chunk_size;
+};
+
+
+static Arena
+new_arena (size_t chunk_size)
+{
+  Arena arena;
+  arena.chunks = 0;
+  arena.chunk_size = chunk_size;
+  return arena;
+}
+
+
+static void *
+arena_alloc (Arena *arena, size_t size)
 {
-  while (is_digit (p[0]))
+  size = (size + 7) & ~(size_t) 7;
+
+  ArenaChunk *chunk = arena->chunks;
+
+  if (!chunk || chunk->used + size > chunk->size)
     {
-      write (1, p++, 1);
+      size_t payload = size > arena->chunk_size ? size : arena->chunk_size;
+      chunk = (ArenaChunk *) malloc (sizeof (ArenaChunk) + payload);
+      assert (chunk);
+      chunk->next = arena->chunks;
+      chunk->used = 0;
+      chunk->size = payload;
+      arena->chunks = chunk;
     }
 
-  return p;
+  void *result = (char *) (chunk + 1) + chunk->used;
+  chunk->used += size;
+  return result;
 }
 
 
+// Recycles the memory without giving it back.
 static void
-u64_to_str (u64 num, char *out)
+arena_reset (Arena *arena)
 {
-  if (num == 0)
+  for (ArenaChunk *chunk = arena->chunks; chunk; chunk = chunk->next)
     {
-      out[0] = '0';
-      out[1] = 0;
-      return;
+      chunk->used = 0;
     }
+}
 
-  char *end = out;
 
-  while (num > 0)
+static void
+arena_free (Arena *arena)
+{
+  ArenaChunk *chunk = arena->chunks;
+
+  while (chunk)
     {
-      u64 new_num = num / 10;
-      char digit = num - new_num * 10;
-      *(end++) = digit + '0';
-      num = new_num;
+      ArenaChunk *next = chunk->next;
+      free (chunk);
+      chunk = next;
     }
 
-  *(end--) = 0;
+  arena->chunks = 0;
+}
 
-  while (out < end)
-    {
-      char tmp = *out;
-      *(out++) = *end;
-      *(end--) = tmp;
-    }
+
+/* Sorted array of line start offsets.  offsets[i] is the buffer
+ * offset of the first byte of line i, so finding the line containing
+ * an offset is a binary search and line starts/lengths are O(1)
+ * lookups instead of byte scans.  Edits shift the tail of the array
+ * and add/remove entries for inserted/deleted newlines.
+ */
+struct LineIndex {
+  size_t *offsets;
+  size_t count;
+  size_t size;
+  Arena *arena;
+};
+
+
+static LineIndex
+new_line_index (Arena *arena)
+{
+  LineIndex index;
+  index.arena = arena;
+  index.size = 64;
+  index.offsets = (size_t *) arena_alloc (arena, index.size * sizeof (size_t));
+  index.count = 0;
+  return index;
 }
 
 
 static void
-s64_to_str (s64 num, char *out)
+line_index_reserve (LineIndex *index, size_t count)
 {
-  if (num < 0)
+  if (index->count + count <= index->size) return;
+
+  while (index->count + count > index->size)
     {
-      *(out++) = '-';
-      num = -num;
+      index->size *= 2;
     }
 
-  u64_to_str (num, out);
+  // Doubling out of the arena strands the old array, which bounds the
+  // waste at the size of the final one.
+  size_t *offsets = (size_t *) arena_alloc (index->arena,
+                                            index->size * sizeof (size_t));
+  memcpy (offsets, index->offsets, index->count * sizeof (size_t));
+  index->offsets = offsets;
 }
 
 
-static b8
-init (char *exec_path)
+static void
+line_index_rebuild (LineIndex *index, Buffer *buffer)
 {
-  char *term = getenv ("TERM");
+  index->count = 0;
+  line_index_reserve (index, 1);
+  index->offsets[index->count++] = 0;
 
-  if (!term)
-    {
-      write (2, exec_path, strlen (exec_path));
-      write (2, STR (": The environment variable TERM isn't set "
-                     "- it should be set to `xterm'.\n"));
-      return 0;
-    }
-  else if (strcmp (term, "xterm") && strcmp (term, "xterm-256color"))
+  size_t text_length = buffer->used ? buffer->used - 1 : 0;
+
+  for (size_t offset = 0; offset < text_length;)
     {
-      // (!strcmp (term, "dumb")
-      write (2, exec_path, strlen (exec_path));
-      write (2, STR (": The environment variable TERM is set to `"));
-      write (2, term, strlen (term));
-      write (2, STR ("' - should be `xterm'.\n"));
-      return 0;
-    }
+      size_t span_length;
+      char *span = buffer_span (buffer, offset, &span_length);
+      if (offset + span_length > text_length)
+        {
+          span_length = text_length - offset;
+        }
 
-  return 1;
+      char *p = span;
+      while ((p = (char *) memchr (p, '\n', span + span_length - p)))
+        {
+          ++p;
+          line_index_reserve (index, 1);
+          index->offsets[index->count++] = offset + (p - span);
+        }
+
+      offset += span_length;
+    }
 }
 
 
-static termios
-init_screen (void)
+// Line containing offset: the largest i with offsets[i] <= offset.
+static size_t
+line_index_find (LineIndex *index, size_t offset)
 {
-  write (1, STR ("\e7"));       // Save cursor position
-  // write (1, STR ("\e[s"));   // Save cursor position
-  write (1, STR ("\e[?47h"));   // Save screen
-  // write (1, STR ("\e[2J"));        // Clear screen
-  // write (1, STR ("\e[?25l"));      // Hide cursor
+  size_t lo = 0;
+  size_t hi = index->count;
 
-  termios original_terminal_attributes;
-  int tcgetattr_error = tcgetattr (0, &original_terminal_attributes);
-  assert (!tcgetattr_error);
-  termios terminal_attributes = original_terminal_attributes;
-  terminal_attributes.c_lflag &= ~ICANON; // Immediate input
-  terminal_attributes.c_lflag &= ~ECHO;   // Don't echo characters
-  terminal_attributes.c_iflag &= ~IXON;   // Disable ^s and ^q
-  int tcsetattr_error = tcsetattr (0, TCSANOW, &terminal_attributes);
-  assert (!tcsetattr_error);
+  while (hi - lo > 1)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (index->offsets[mid] <= offset) lo = mid;
+      else                               hi = mid;
+    }
 
-  return original_terminal_attributes;
+  return lo;
 }
 
 
-static void
-destroy_screen (termios original_terminal_attributes)
+// Length of a line in bytes, the terminating newline excluded.
+static size_t
+line_index_line_length (LineIndex *index, Buffer *buffer, size_t line)
 {
-  // TODO: Use restore screen to restore colors?
+  size_t start = index->offsets[line];
 
-  int tcsetattr_error = tcsetattr (0, TCSADRAIN, &original_terminal_attributes);
-  assert (!tcsetattr_error);
+  if (line + 1 < index->count)
+    {
+      return index->offsets[line + 1] - 1 - start;
+    }
 
-  write (1, STR ("\e[?47l"));   // Restore screen
-  write (1, STR ("\e8"));       // Restore cursor position
-  // write (1, STR ("\e[u"));   // Restore cursor position
-  // write (1, STR ("\e[?25h"));   // Unhide cursor
+  size_t text_length = buffer->used ? buffer->used - 1 : 0;
+  return text_length - start;
 }
 
-static Buffer
-load_file (const char *filepath)
+
+// Call after buffer_insert_at with the same offset and length.
+static void
+line_index_insert (LineIndex *index, Buffer *buffer, size_t offset, size_t length)
 {
-  int fd = open (filepath, O_RDONLY);
-  assert (fd != -1);
+  size_t line = line_index_find (index, offset);
 
-  struct stat file_stat;
-  int fstat_error = fstat (fd, &file_stat);
-  assert (!fstat_error);
+  for (size_t i = line + 1; i < index->count; ++i)
+    {
+      index->offsets[i] += length;
+    }
 
-  Buffer buffer = new_buffer (file_stat.st_size + 1);
+  size_t newlines = 0;
+  for (size_t pos = offset; pos < offset + length; ++pos)
+    {
+      if (buffer_char_at (buffer, pos) == '\n') ++newlines;
+    }
 
-  ssize_t bytes_read = read (fd, buffer.data, file_stat.st_size);
-  assert (bytes_read != -1);
-  assert (bytes_read == file_stat.st_size);
-  buffer.data[file_stat.st_size] = 0;
-  buffer.used = file_stat.st_size + 1;
+  if (newlines == 0) return;
 
-  for (char *buffer_p = parse_space (buffer.data); *buffer_p;)
+  line_index_reserve (index, newlines);
+  memmove (index->offsets + line + 1 + newlines,
+           index->offsets + line + 1,
+           (index->count - line - 1) * sizeof (size_t));
+  index->count += newlines;
+
+  size_t entry = line + 1;
+  for (size_t pos = offset; pos < offset + length; ++pos)
     {
-      char c = buffer_p[0];
-      if (c == '/')
-        {
-          if (buffer_p[1] == '*')
-            {
-              write (1, "\e[6m", 5);
-              buffer_p = parse_block_comment (buffer_p);
-              write (1, "\e[m", 3);
-            }
-          else if (buffer_p[1] == '/')
-            {
-              write (1, "\e[30m", 5);
-              buffer_p = parse_inline_comment (buffer_p);
-              write (1, "\e[m", 3);
-            }
-          else
-            {
-              write (1, buffer_p++, 1);
-            }
-        }
-      else if (c == '"')
-        {
-          write (1, "\e[1;33m", 7); // bold + green font effect
-          write (1, buffer_p++, 1);
-          buffer_p = parse_string_literal (buffer_p);
-          write (1, "\e[m", 3); // disable font effects
-        }
-      else if (c == '(' || c == ')' ||
-               c == '{' || c == '}' ||
-               c == '[' || c == ']' ||
-               c == '=' ||
-               c == ',' ||
-               c == ';' ||
-               c == '*' ||
-               c == '&')
+      if (buffer_char_at (buffer, pos) == '\n')
         {
-          write (1, buffer_p++, 1);
-        }
-      else if (is_latin (c))
-        {
-          write (1, "\e[1;34m", 7); // bold + green font effect
-          buffer_p = parse_identifier (buffer_p);
-          write (1, "\e[m", 3); // disable font effects
-        }
-      else if (is_digit (c))
-        {
-          buffer_p = parse_num (buffer_p);
-        }
-      else
-        {
-          printf ("\nError: Unable to parse %d ('%c')\n", *buffer_p, *buffer_p);
+          index->offsets[entry++] = pos + 1;
         }
+    }
+}
+
+
+// Call before buffer_delete_range with the same offset and length.
+static void
+line_index_delete (LineIndex *index, size_t offset, size_t length)
+{
+  size_t line = line_index_find (index, offset);
 
-      buffer_p = parse_space (buffer_p);
+  size_t remove_begin = line + 1;
+  size_t remove_end = remove_begin;
+  while (remove_end < index->count &&
+         index->offsets[remove_end] <= offset + length)
+    {
+      ++remove_end;
     }
 
-  return buffer;
+  memmove (index->offsets + remove_begin,
+           index->offsets + remove_end,
+           (index->count - remove_end) * sizeof (size_t));
+  index->count -= remove_end - remove_begin;
+
+  for (size_t i = remove_begin; i < index->count; ++i)
+    {
+      index->offsets[i] -= length;
+    }
 }
 
+/* Batches terminal output into large write() calls.  Emitting the
+ * highlighted form of a big file one byte at a time costs one syscall
+ * per character; appending into this buffer and flushing once per
+ * frame makes a repaint one or two write() calls.
+ */
+struct OutputBuffer {
+  Buffer buffer;
+  int fd;
+};
+
 
-int
-main (int argc, char **argv)
+static OutputBuffer
+new_output_buffer (int fd, size_t size)
 {
-  if (!init (argv[0])) return 1;
+  OutputBuffer out;
+  out.buffer = new_buffer (size);
+  out.fd = fd;
+  return out;
+}
 
-  Buffer buffer;
-  if (argc == 2) buffer = load_file (argv[1]);
-  else           buffer = new_buffer (4096);
 
-  termios original_terminal_attributes = init_screen ();
+// Totals over all OutputBuffers - the perf HUD shows per-frame deltas.
+static u64 out_total_bytes;
+static u64 out_total_writes;
 
-  write (1, STR ("\e[H"));      // Move cursor to top left
-  size_t x = 0;
-  size_t y = 0;
-  int keep_running = 1;
 
-  char line_buffer[1024];
-  line_buffer[0] = 0;
+static void
+out_flush (OutputBuffer *out)
+{
+  if (out->buffer.used > 0)
+    {
+      write (out->fd, out->buffer.data, out->buffer.used);
+      out_total_bytes += out->buffer.used;
+      ++out_total_writes;
+      out->buffer.used = 0;
+    }
+}
+
 
-  while (keep_running)
+static void
+out_append (OutputBuffer *out, const char *data, size_t length)
+{
+  if (!out) return;
+
+  if (out->buffer.used + length > out->buffer.size)
     {
-      struct winsize window_size;
-      ioctl (STDOUT_FILENO, TIOCGWINSZ, &window_size);
+      out_flush (out);
 
-      printf ("\e[%u;1H\e[7m", window_size.ws_row);
-      fflush (stdout);
-      size_t line_buffer_len = strlen (line_buffer);
-      for (int i = line_buffer_len; i < window_size.ws_col; ++i)
+      if (length > out->buffer.size)
         {
-          line_buffer[i] = '-';
+          // Too big to ever fit - bypass the buffer.
+          write (out->fd, data, length);
+          out_total_bytes += length;
+          ++out_total_writes;
+          return;
         }
-      write (1, line_buffer, window_size.ws_col);
-      line_buffer[0] = 0;
-      printf ("\e[0m\e[%lu;%luH", y+1, x+1); fflush (stdout);
+    }
 
-      char input[64];
-      ssize_t bytes_read = read (0, input, 64);
-      assert (bytes_read != -1);
-      sprintf  (line_buffer, "Size: %ux%u; Status: \"",
-                window_size.ws_col,
-                window_size.ws_row);
+  memcpy (out->buffer.data + out->buffer.used, data, length);
+  out->buffer.used += length;
+}
 
-      for (int i = 0; i < bytes_read; ++i)
-        {
-          char numstr[64];
-          if (input[i] >= ' ' && input[i] <= '~')
-            {
-              sprintf (numstr, "%c", input[i]);
+
+static void
+out_append_char (OutputBuffer *out, char c)
+{
+  if (!out) return;
+
+  if (out->buffer.used == out->buffer.size)
+    {
+      out_flush (out);
+    }
+
+  out->buffer.data[out->buffer.used++] = c;
+}
+
+
+/* Double-buffered screen.  Rendering paints cells (character +
+ * attribute) into the back grid; screen_flush diffs it against the
+ * front grid (what the terminal currently shows) and emits
+ * cursor-move and SGR sequences only for the changed runs, so a frame
+ * where little changed costs a handful of bytes on the wire.
+ */
+enum CellAttr {
+  CELL_ATTR_PLAIN,
+  CELL_ATTR_COMMENT,
+  CELL_ATTR_INLINE_COMMENT,
+  CELL_ATTR_STRING,
+  CELL_ATTR_IDENTIFIER,
+  CELL_ATTR_KEYWORD,
+  CELL_ATTR_TYPE,
+  CELL_ATTR_STATUS,
+  CELL_ATTR_COUNT,
+};
+
+
+/* Themes.  A token class maps to a ThemeEntry - a 16-color SGR plus
+ * optional 256-color and truecolor values - and theme_init generates
+ * the actual escape sequences once at startup, at the depth the
+ * terminal profile reports (COLORTERM=truecolor upgrades to 24-bit),
+ * into fixed slots.  Emission cost doesn't change with theming: an
+ * attribute switch stays one length-cached copy, and the cell diff
+ * already emits nothing inside a run of one attribute.  TTE_THEME
+ * selects a theme by name; unknown names keep the default.
+ */
+struct ThemeEntry {
+  const char *base;   // 16-color SGR, also reset and reverse video
+  u8 index;           // 256-color palette index; 0 keeps base
+  u32 rgb;            // truecolor 0xrrggbb; 0 keeps the level below
+};
+
+struct Theme {
+  const char *name;
+  ThemeEntry entries[CELL_ATTR_COUNT];
+};
+
+static const Theme themes[] = {
+  {"default", {
+    {"\e[m",        0,   0},         // plain
+    {"\e[0;6m",     66,  0x5f8787},  // comment
+    {"\e[0;30m",    59,  0x4e4e4e},  // inline comment
+    {"\e[0;1;33m", 185, 0xd7d75f},  // string
+    {"\e[0;1;34m",  75, 0x5fafff},  // identifier
+    {"\e[0;1;35m", 176, 0xd787d7},  // keyword
+    {"\e[0;1;32m", 114, 0x87d787},  // type
+    {"\e[0;7m",      0,   0},        // status (reverse video)
+  }},
+  {"mono", {
+    {"\e[m",    0, 0},               // plain
+    {"\e[0;2m", 0, 0},               // comment
+    {"\e[0;2m", 0, 0},               // inline comment
+    {"\e[0;1m", 0, 0},               // string
+    {"\e[m",    0, 0},               // identifier
+    {"\e[0;1m", 0, 0},               // keyword
+    {"\e[0;4m", 0, 0},               // type
+    {"\e[0;7m", 0, 0},               // status
+  }},
+};
+
+// Longest generated form: "\e[0;38;2;255;255;255m".
+static char cell_attr_sgr[CELL_ATTR_COUNT][24];
+static u8 cell_attr_sgr_length[CELL_ATTR_COUNT];
+static u32 theme_color_depth = 16;  // raised by main from the profile
+static b8 theme_ready;
+
+
+static void
+theme_init (void)
+{
+  if (theme_ready) return;
+
+  const Theme *theme = &themes[0];
+  const char *name = getenv ("TTE_THEME");
+
+  for (size_t i = 0; name && i < sizeof (themes) / sizeof (*themes); ++i)
+    {
+      if (!strcmp (name, themes[i].name))
+        {
+          theme = &themes[i];
+          break;
+        }
+    }
+
+  for (size_t attr = 0; attr < CELL_ATTR_COUNT; ++attr)
+    {
+      const ThemeEntry *entry = &theme->entries[attr];
+      char *slot = cell_attr_sgr[attr];
+
+      if (theme_color_depth > 256 && entry->rgb)
+        {
+          sprintf (slot, "\e[0;38;2;%u;%u;%um",
+                   entry->rgb >> 16, (entry->rgb >> 8) & 0xff,
+                   entry->rgb & 0xff);
+        }
+      else if (theme_color_depth >= 256 && entry->index)
+        {
+          sprintf (slot, "\e[0;38;5;%um", entry->index);
+        }
+      else
+        {
+          strcpy (slot, entry->base);
+        }
+
+      cell_attr_sgr_length[attr] = strlen (slot);
+    }
+
+  theme_ready = 1;
+}
+
+/* UTF-8.  The cell grid stores decoded codepoints, so a multibyte
+ * character occupies one cell and is re-encoded on emission.  The
+ * decoder validates as it goes - invalid, overlong or truncated
+ * sequences decode as U+FFFD consuming one byte, so damaged input
+ * renders as a marker per byte instead of flooding the output with
+ * errors.  Mostly-ASCII files pay nothing: scan_ascii skips whole
+ * vector widths (the sign-bit movemask is exactly the non-ASCII test)
+ * and the byte paths below only branch on the high bit.
+ */
+#if defined (__AVX2__) && !defined (TTE_SCALAR)
+
+#include <immintrin.h>
+
+#define TTE_VEC_BYTES 32
+typedef __m256i TteVec;
+#define tte_vec_load(p)     _mm256_load_si256 ((const __m256i *) (p))
+#define tte_vec_set1(c)     _mm256_set1_epi8 (c)
+#define tte_vec_cmpeq(a, b) _mm256_cmpeq_epi8 (a, b)
+#define tte_vec_cmpgt(a, b) _mm256_cmpgt_epi8 (a, b)
+#define tte_vec_or(a, b)    _mm256_or_si256 (a, b)
+#define tte_vec_and(a, b)   _mm256_and_si256 (a, b)
+#define tte_vec_mask(v)     ((u32) _mm256_movemask_epi8 (v))
+#define TTE_VEC_MASK_ALL    0xffffffffu
+
+#elif defined (__SSE2__) && !defined (TTE_SCALAR)
+
+#include <emmintrin.h>
+
+#define TTE_VEC_BYTES 16
+typedef __m128i TteVec;
+#define tte_vec_load(p)     _mm_load_si128 ((const __m128i *) (p))
+#define tte_vec_set1(c)     _mm_set1_epi8 (c)
+#define tte_vec_cmpeq(a, b) _mm_cmpeq_epi8 (a, b)
+#define tte_vec_cmpgt(a, b) _mm_cmpgt_epi8 (a, b)
+#define tte_vec_or(a, b)    _mm_or_si128 (a, b)
+#define tte_vec_and(a, b)   _mm_and_si128 (a, b)
+#define tte_vec_mask(v)     ((u32) _mm_movemask_epi8 (v))
+#define TTE_VEC_MASK_ALL    0xffffu
+
+#endif
+
+
+#define UTF8_REPLACEMENT 0xfffd
+
+
+static int
+is_utf8_continuation (char c)
+{
+  return (c & 0xc0) == 0x80;
+}
+
+
+// First byte at or after p with the high bit set, bounded by end.
+static const char *
+scan_ascii (const char *p, const char *end)
+{
+#ifdef TTE_VEC_BYTES
+  while (p < end && ((uintptr_t) p & (TTE_VEC_BYTES - 1)))
+    {
+      if (*p & 0x80) return p;
+      ++p;
+    }
+
+  while (p + TTE_VEC_BYTES <= end)
+    {
+      u32 mask = tte_vec_mask (tte_vec_load (p));
+      if (mask) return p + __builtin_ctz (mask);
+      p += TTE_VEC_BYTES;
+    }
+#endif
+
+  while (p < end && !(*p & 0x80)) ++p;
+  return p;
+}
+
+
+// Decodes one character; always consumes at least one byte.
+static size_t
+utf8_decode (const char *p, const char *end, u32 *codepoint)
+{
+  u8 lead = p[0];
+
+  if (lead < 0x80)
+    {
+      *codepoint = lead;
+      return 1;
+    }
+
+  size_t length;
+  u32 value;
+  u32 minimum;
+
+  if ((lead & 0xe0) == 0xc0)      { length = 2; value = lead & 0x1f; minimum = 0x80; }
+  else if ((lead & 0xf0) == 0xe0) { length = 3; value = lead & 0x0f; minimum = 0x800; }
+  else if ((lead & 0xf8) == 0xf0) { length = 4; value = lead & 0x07; minimum = 0x10000; }
+  else
+    {
+      *codepoint = UTF8_REPLACEMENT;
+      return 1;
+    }
+
+  if (p + length > end)
+    {
+      *codepoint = UTF8_REPLACEMENT;
+      return 1;
+    }
+
+  for (size_t i = 1; i < length; ++i)
+    {
+      if (!is_utf8_continuation (p[i]))
+        {
+          *codepoint = UTF8_REPLACEMENT;
+          return 1;
+        }
+      value = (value << 6) | (p[i] & 0x3f);
+    }
+
+  // Overlong forms, surrogates and out-of-range values are invalid.
+  if (value < minimum || value > 0x10ffff ||
+      (value >= 0xd800 && value <= 0xdfff))
+    {
+      *codepoint = UTF8_REPLACEMENT;
+      return 1;
+    }
+
+  *codepoint = value;
+  return length;
+}
+
+
+static size_t
+utf8_encode (u32 codepoint, char *out)
+{
+  if (codepoint < 0x80)
+    {
+      out[0] = codepoint;
+      return 1;
+    }
+
+  if (codepoint < 0x800)
+    {
+      out[0] = 0xc0 | (codepoint >> 6);
+      out[1] = 0x80 | (codepoint & 0x3f);
+      return 2;
+    }
+
+  if (codepoint < 0x10000)
+    {
+      out[0] = 0xe0 | (codepoint >> 12);
+      out[1] = 0x80 | ((codepoint >> 6) & 0x3f);
+      out[2] = 0x80 | (codepoint & 0x3f);
+      return 3;
+    }
+
+  out[0] = 0xf0 | (codepoint >> 18);
+  out[1] = 0x80 | ((codepoint >> 12) & 0x3f);
+  out[2] = 0x80 | ((codepoint >> 6) & 0x3f);
+  out[3] = 0x80 | (codepoint & 0x3f);
+  return 4;
+}
+
+
+struct Cell {
+  u32 cp;    // Decoded codepoint - one cell per character, ASCII or not
+  u8 attr;
+};
+
+/* Escape-sequence cache.  screen_flush emits a cursor address for
+ * every damaged run and an SGR for every attribute change; formatting
+ * those with sprintf/strlen each time costs more than copying the
+ * payload.  On resize every "\e[row;colH" for the grid is formatted
+ * once into a fixed-stride table, and the SGR lengths are measured
+ * once, so emission is a single length-known out_append.
+ */
+#define SCREEN_ADDRESS_STRIDE 16
+
+
+struct Screen {
+  Cell *front;
+  Cell *back;
+  char *addresses;      // rows * cols cached cursor addresses
+  u8 *address_lengths;
+  u16 rows;
+  u16 cols;
+  b8 valid;  // front reflects what is on the terminal
+};
+
+
+static Screen
+new_screen (void)
+{
+  Screen screen;
+  screen.front = 0;
+  screen.back = 0;
+  screen.addresses = 0;
+  screen.address_lengths = 0;
+  screen.rows = 0;
+  screen.cols = 0;
+  screen.valid = 0;
+
+  theme_init ();  // SGR slots and their lengths, once
+
+  return screen;
+}
+
+
+static void
+screen_resize (Screen *screen, u16 rows, u16 cols)
+{
+  if (screen->rows == rows && screen->cols == cols) return;
+
+  free (screen->front);
+  free (screen->back);
+  free (screen->addresses);
+  free (screen->address_lengths);
+
+  size_t cell_count = (size_t) rows * cols;
+  screen->front = (Cell *) malloc (cell_count * sizeof (Cell));
+  screen->back = (Cell *) malloc (cell_count * sizeof (Cell));
+  screen->addresses = (char *) malloc (cell_count * SCREEN_ADDRESS_STRIDE);
+  screen->address_lengths = (u8 *) malloc (cell_count);
+  assert (screen->front && screen->back &&
+          screen->addresses && screen->address_lengths);
+
+  for (size_t i = 0; i < cell_count; ++i)
+    {
+      screen->back[i].cp = ' ';
+      screen->back[i].attr = CELL_ATTR_PLAIN;
+    }
+
+  for (u16 row = 0; row < rows; ++row)
+    {
+      for (u16 col = 0; col < cols; ++col)
+        {
+          size_t i = (size_t) row * cols + col;
+          screen->address_lengths[i] =
+            sprintf (screen->addresses + i * SCREEN_ADDRESS_STRIDE,
+                     "\e[%u;%uH", row + 1, col + 1);
+        }
+    }
+
+  screen->rows = rows;
+  screen->cols = cols;
+  screen->valid = 0;
+}
+
+
+// Appends the cached cursor address of a grid cell (0-based).
+static void
+screen_emit_address (Screen *screen, OutputBuffer *out, u16 row, u16 col)
+{
+  size_t i = (size_t) row * screen->cols + col;
+  out_append (out, screen->addresses + i * SCREEN_ADDRESS_STRIDE,
+              screen->address_lengths[i]);
+}
+
+
+static void
+screen_flush (Screen *screen, OutputBuffer *out)
+{
+  u8 attr = 0xff;  // unknown - force the first SGR
+
+  for (u16 row = 0; row < screen->rows; ++row)
+    {
+      Cell *front = screen->front + (size_t) row * screen->cols;
+      Cell *back = screen->back + (size_t) row * screen->cols;
+
+      for (u16 col = 0; col < screen->cols;)
+        {
+          if (screen->valid &&
+              front[col].cp == back[col].cp &&
+              front[col].attr == back[col].attr)
+            {
+              ++col;
+              continue;
+            }
+
+          // Start of a changed run.
+          screen_emit_address (screen, out, row, col);
+
+          while (col < screen->cols &&
+                 (!screen->valid ||
+                  front[col].cp != back[col].cp ||
+                  front[col].attr != back[col].attr))
+            {
+              if (back[col].attr != attr)
+                {
+                  attr = back[col].attr;
+                  out_append (out, cell_attr_sgr[attr],
+                              cell_attr_sgr_length[attr]);
+                }
+
+              if (back[col].cp < 0x80)
+                {
+                  out_append_char (out, back[col].cp);
+                }
+              else
+                {
+                  char encoded[4];
+                  out_append (out, encoded,
+                              utf8_encode (back[col].cp, encoded));
+                }
+              front[col] = back[col];
+              ++col;
+            }
+        }
+    }
+
+  screen->valid = 1;
+}
+
+
+/* Hardware scroll.  A one-line scroll must not retransmit the whole
+ * viewport: the terminal shifts its text rows inside a scroll region
+ * (the status row on the last line stays put), the front grid shifts
+ * the same way, and the next flush finds every moved row already
+ * matching - only the newly exposed lines transmit.  Paging over a
+ * high-latency link costs one line per step instead of a screenful.
+ */
+static void
+screen_scroll (Screen *screen, OutputBuffer *out, int delta)
+{
+  int text_rows = screen->rows - 1;
+
+  if (!screen->valid || delta == 0 ||
+      delta >= text_rows || -delta >= text_rows)
+    {
+      return;
+    }
+
+  // \e[1;Nr confines scrolling to the text rows, \e[S/\e[T shifts,
+  // \e[r lifts the region again.
+  char sequence[32];
+  int length = sprintf (sequence, "\e[1;%dr\e[%d%c\e[r",
+                        text_rows,
+                        delta > 0 ? delta : -delta,
+                        delta > 0 ? 'S' : 'T');
+  out_append (out, sequence, length);
+
+  Cell *front = screen->front;
+  size_t cols = screen->cols;
+  int exposed_begin;
+
+  if (delta > 0)
+    {
+      memmove (front, front + (size_t) delta * cols,
+               (size_t) (text_rows - delta) * cols * sizeof (Cell));
+      exposed_begin = text_rows - delta;
+    }
+  else
+    {
+      memmove (front + (size_t) -delta * cols, front,
+               (size_t) (text_rows + delta) * cols * sizeof (Cell));
+      exposed_begin = 0;
+    }
+
+  // The exposed rows hold blanks on the terminal; an impossible cell
+  // forces the flush to repaint them whatever the back grid holds.
+  int exposed_count = delta > 0 ? delta : -delta;
+  for (size_t i = (size_t) exposed_begin * cols;
+       i < ((size_t) exposed_begin + exposed_count) * cols;
+       ++i)
+    {
+      front[i].cp = 0;
+      front[i].attr = (u8) -1;
+    }
+}
+
+
+/* Paints text into one row of the back grid, expanding tabs and
+ * clipping at the right edge.  A null writer is the context-only
+ * highlight pass.
+ */
+struct RowWriter {
+  Cell *cells;
+  size_t pos;   // Absolute display column, left-scrolled part included
+  size_t left;  // First visible display column
+  u16 cols;
+  u16 col;      // Next cell to paint - pos - left while inside the window
+  u8 attr;
+};
+
+
+static void
+row_set_attr (RowWriter *row, u8 attr)
+{
+  if (row) row->attr = attr;
+}
+
+
+static void
+row_put (RowWriter *row, const char *data, size_t length)
+{
+  if (!row) return;
+
+  // Everything visible is already painted.
+  if (row->pos >= row->left + row->cols) return;
+
+  // A run ending before the visible window with no tab stops to
+  // expand and no multibyte characters (all-ASCII means byte count ==
+  // column count) advances the position without touching each byte,
+  // so a left-scrolled 500k-character line doesn't cost 500k
+  // iterations.
+  if (row->pos + length <= row->left &&
+      scan_ascii (data, data + length) == data + length &&
+      !memchr (data, '\t', length) &&
+      !memchr (data, '\n', length))
+    {
+      row->pos += length;
+      return;
+    }
+
+  size_t i = 0;
+  while (i < length)
+    {
+      char c = data[i];
+
+      if (c == '\n') break;
+      if (c == '\r')
+        {
+          ++i;
+          continue;
+        }
+
+      u32 codepoint = (u8) c;
+      size_t char_length = 1;
+
+      if (c & 0x80)
+        {
+          char_length = utf8_decode (data + i, data + length, &codepoint);
+        }
+
+      size_t stop = c == '\t' ? (row->pos / 8 + 1) * 8 : row->pos + 1;
+
+      while (row->pos < stop)
+        {
+          if (row->pos >= row->left + row->cols) return;
+
+          if (row->pos >= row->left)
+            {
+              row->cells[row->col].cp = c == '\t' ? ' ' : codepoint;
+              row->cells[row->col].attr = row->attr;
+              ++row->col;
+            }
+
+          ++row->pos;
+        }
+
+      i += char_length;
+    }
+}
+
+
+static void
+row_put_char (RowWriter *row, char c)
+{
+  row_put (row, &c, 1);
+}
+
+
+enum TextContextType {
+  TEXT_CONTEXT_GLOBAL,
+  TEXT_CONTEXT_BLOCK_COMMENT,
+  TEXT_CONTEXT_INLINE_COMMENT,
+  TEXT_CONTEXT_STRING_LITERAL,
+  TEXT_CONTEXT_CHAR_LITERAL,
+};
+
+struct TextContext {
+  TextContextType type;
+  size_t length;
+};
+
+
+static int
+is_latin (char c)
+{
+  return ((c >= 'A' && c <= 'Z') ||
+          (c >= 'a' && c <= 'z'));
+}
+
+
+static int
+is_digit (char c)
+{
+  return (c >= '0' && c <= '9');
+}
+
+
+static int
+is_ident (char c)
+{
+  return (is_latin (c) ||
+          is_digit (c) ||
+          c == '_');
+}
+
+
+static int
+is_space (char c)
+{
+  return (c == ' '  ||
+          c == '\n' ||
+          c == '\r' ||
+          c == '\t');
+}
+
+
+/* Character classes.  One 256-entry table load classifies a byte for
+ * the highlight dispatcher and the literal scanner - no branchy
+ * is_digit/is_latin chains on the per-byte path.  Filled once before
+ * any worker thread parses, next to the keyword table.
+ */
+enum CharClass {
+  CHAR_CLASS_SPACE   = 1 << 0,
+  CHAR_CLASS_DIGIT   = 1 << 1,
+  CHAR_CLASS_IDENT_0 = 1 << 2,  // can start an identifier
+  CHAR_CLASS_NUMBER  = 1 << 3,  // can continue a numeric literal
+};
+
+static u8 char_class[256];
+static b8 char_class_ready;
+
+
+static void
+char_class_init (void)
+{
+  if (char_class_ready) return;
+
+  for (int c = 0; c < 256; ++c)
+    {
+      u8 flags = 0;
+
+      if (is_space (c)) flags |= CHAR_CLASS_SPACE;
+      if (c >= '0' && c <= '9') flags |= CHAR_CLASS_DIGIT |
+                                         CHAR_CLASS_NUMBER;
+      if ((c >= 'a' && c <= 'z') ||
+          (c >= 'A' && c <= 'Z') ||
+          c == '_')
+        {
+          flags |= CHAR_CLASS_IDENT_0;
+        }
+
+      char_class[c] = flags;
+    }
+
+  /* Everything that can continue a number: hex digits, the radix
+   * point, base prefixes (0x1p3, 0b101, 0o17), exponents, type
+   * suffixes and C++14 digit separators.  parse_num is only entered
+   * from a digit, so the letters here never start a token.
+   */
+  static const char number_body[] = "abcdefABCDEF" "xXoO" "pP" "uUlL" ".'";
+  for (const char *c = number_body; *c; ++c)
+    {
+      char_class[(u8) *c] |= CHAR_CLASS_NUMBER;
+    }
+
+  char_class_ready = 1;
+}
+
+
+/* Vectorized scan kernels.  The highlight loop spends its time finding
+ * the end of whitespace/identifier/number/string runs, so these advance
+ * 16 (SSE2) or 32 (AVX2) bytes per iteration instead of one.  The
+ * vector width macros sit further up so the UTF-8 ASCII scan can share
+ * them.
+ *
+ * Each kernel first steps bytes until p is vector-aligned, then uses
+ * aligned loads only.  An aligned load never crosses a page boundary,
+ * so reading a few bytes past the terminating NUL is safe even for
+ * mmap'd buffers.
+ */
+
+// End of the whitespace run starting at p.
+static char *
+scan_space (char *p)
+{
+#ifdef TTE_VEC_BYTES
+  while ((uintptr_t) p & (TTE_VEC_BYTES - 1))
+    {
+      if (!is_space (*p)) return p;
+      ++p;
+    }
+
+  for (;;)
+    {
+      TteVec chunk = tte_vec_load (p);
+      TteVec space = tte_vec_cmpeq (chunk, tte_vec_set1 (' '));
+      space = tte_vec_or (space, tte_vec_cmpeq (chunk, tte_vec_set1 ('\n')));
+      space = tte_vec_or (space, tte_vec_cmpeq (chunk, tte_vec_set1 ('\r')));
+      space = tte_vec_or (space, tte_vec_cmpeq (chunk, tte_vec_set1 ('\t')));
+
+      u32 mask = ~tte_vec_mask (space) & TTE_VEC_MASK_ALL;
+      if (mask) return p + __builtin_ctz (mask);
+      p += TTE_VEC_BYTES;
+    }
+#else
+  while (is_space (*p)) ++p;
+  return p;
+#endif
+}
+
+
+// End of the [A-Za-z0-9_] run starting at p.
+static char *
+scan_identifier (char *p)
+{
+#ifdef TTE_VEC_BYTES
+  while ((uintptr_t) p & (TTE_VEC_BYTES - 1))
+    {
+      if (!is_ident (*p)) return p;
+      ++p;
+    }
+
+  for (;;)
+    {
+      // Folding to lowercase with |0x20 turns both cases into one
+      // range check; bytes >= 0x80 go negative and compare out.
+      TteVec chunk = tte_vec_load (p);
+      TteVec lower = tte_vec_or (chunk, tte_vec_set1 (0x20));
+      TteVec ident =
+        tte_vec_and (tte_vec_cmpgt (lower, tte_vec_set1 ('a' - 1)),
+                     tte_vec_cmpgt (tte_vec_set1 ('z' + 1), lower));
+      ident =
+        tte_vec_or (ident,
+                    tte_vec_and (tte_vec_cmpgt (chunk, tte_vec_set1 ('0' - 1)),
+                                 tte_vec_cmpgt (tte_vec_set1 ('9' + 1), chunk)));
+      ident = tte_vec_or (ident, tte_vec_cmpeq (chunk, tte_vec_set1 ('_')));
+
+      u32 mask = ~tte_vec_mask (ident) & TTE_VEC_MASK_ALL;
+      if (mask) return p + __builtin_ctz (mask);
+      p += TTE_VEC_BYTES;
+    }
+#else
+  while (is_ident (*p)) ++p;
+  return p;
+#endif
+}
+
+
+// End of the [0-9] run starting at p.
+static char *
+scan_num (char *p)
+{
+#ifdef TTE_VEC_BYTES
+  while ((uintptr_t) p & (TTE_VEC_BYTES - 1))
+    {
+      if (!is_digit (*p)) return p;
+      ++p;
+    }
+
+  for (;;)
+    {
+      TteVec chunk = tte_vec_load (p);
+      TteVec digit =
+        tte_vec_and (tte_vec_cmpgt (chunk, tte_vec_set1 ('0' - 1)),
+                     tte_vec_cmpgt (tte_vec_set1 ('9' + 1), chunk));
+
+      u32 mask = ~tte_vec_mask (digit) & TTE_VEC_MASK_ALL;
+      if (mask) return p + __builtin_ctz (mask);
+      p += TTE_VEC_BYTES;
+    }
+#else
+  while (is_digit (*p)) ++p;
+  return p;
+#endif
+}
+
+
+// First '"' or NUL at or after p; the caller handles escapes.
+static char *
+scan_string_delim (char *p)
+{
+#ifdef TTE_VEC_BYTES
+  while ((uintptr_t) p & (TTE_VEC_BYTES - 1))
+    {
+      if (!*p || *p == '"') return p;
+      ++p;
+    }
+
+  for (;;)
+    {
+      TteVec chunk = tte_vec_load (p);
+      TteVec delim = tte_vec_or (tte_vec_cmpeq (chunk, tte_vec_set1 ('"')),
+                                 tte_vec_cmpeq (chunk, tte_vec_set1 (0)));
+
+      u32 mask = tte_vec_mask (delim);
+      if (mask) return p + __builtin_ctz (mask);
+      p += TTE_VEC_BYTES;
+    }
+#else
+  while (*p && *p != '"') ++p;
+  return p;
+#endif
+}
+
+
+static char *
+parse_space (char *p, char *end, RowWriter *row)
+{
+  char *stop = scan_space (p);
+  if (stop > end) stop = end;
+  row_put (row, p, stop - p);
+  return stop;
+}
+
+
+static char *
+parse_block_comment (char *p, char *end, RowWriter *row)
+{
+  char *start = p;
+
+  while (p < end)
+    {
+      char *star = (char *) memchr (p, '*', end - p);
+      if (!star)
+        {
+          p = end;
+          break;
+        }
+      if (star + 1 < end && star[1] == '/')
+        {
+          p = star + 2;
+          break;
+        }
+      p = star + 1;
+    }
+
+  row_put (row, start, p - start);
+  return p;
+}
+
+
+static char *
+parse_inline_comment (char *p, char *end, RowWriter *row)
+{
+  char *start = p;
+
+  while (p < end &&
+         *p != '\n' &&
+         *p != '\r')
+    {
+      ++p;
+    }
+
+  row_put (row, start, p - start);
+  return p;
+}
+
+
+static char *
+parse_string_literal (char *p, char *end, RowWriter *row)
+{
+  char *start = p;
+
+  while (p < end)
+    {
+      char *delim = scan_string_delim (p);
+
+      if (delim >= end)
+        {
+          p = end;
+          break;
+        }
+
+      p = delim + 1;
+      if (delim == start || delim[-1] != '\\') break;
+    }
+
+  row_put (row, start, p - start);
+  return p;
+}
+
+
+// Body of a char literal after the opening quote; escapes consume
+// their following byte so an escaped quote never closes the literal.
+static char *
+parse_char_literal (char *p, char *end, RowWriter *row)
+{
+  char *start = p;
+
+  while (p < end && *p != '\'' && *p != '\n')
+    {
+      p += (*p == '\\' && p + 1 < end) ? 2 : 1;
+    }
+
+  if (p < end && *p == '\'') ++p;
+
+  row_put (row, start, p - start);
+  return p;
+}
+
+
+/* Keyword classification.  The C/C++ keywords and type names below
+ * hash collision-free into a 1024-slot table (the asserts in init
+ * guarantee it stays that way when words are added), so classifying a
+ * token is one hash over its bytes, one table load and one memcmp -
+ * no strcmp chain.  This runs once per identifier over every byte of
+ * every file opened, so it sits directly on the highlight path.
+ */
+#define KEYWORD_TABLE_SIZE 1024
+
+struct KeywordSlot {
+  const char *word;
+  u8 length;
+  u8 attr;
+};
+
+static KeywordSlot keyword_table[KEYWORD_TABLE_SIZE];
+static b8 keyword_table_ready;
+
+
+static u32
+keyword_hash (const char *p, size_t length)
+{
+  u32 hash = 2166136261u;
+
+  for (size_t i = 0; i < length; ++i)
+    {
+      hash = (hash ^ (u8) p[i]) * 16777619u;
+    }
+
+  // Folding the high bits back in is what makes the table below
+  // collision-free at this size.
+  return (hash ^ (hash >> 6)) & (KEYWORD_TABLE_SIZE - 1);
+}
+
+
+static void
+keyword_table_insert (const char **words, u8 attr)
+{
+  for (size_t i = 0; words[i]; ++i)
+    {
+      KeywordSlot *slot = &keyword_table[keyword_hash (words[i],
+                                                       strlen (words[i]))];
+      assert (!slot->word);  // grew a collision - pick a new fold/size
+      slot->word = words[i];
+      slot->length = strlen (words[i]);
+      slot->attr = attr;
+    }
+}
+
+
+static void
+keyword_table_init (void)
+{
+  if (keyword_table_ready) return;
+
+  static const char *keywords[] = {
+    "auto", "break", "case", "catch", "class", "const", "constexpr",
+    "continue", "default", "delete", "do", "else", "enum", "explicit",
+    "extern", "for", "friend", "goto", "if", "inline", "mutable",
+    "namespace", "new", "noexcept", "operator", "private", "protected",
+    "public", "register", "return", "sizeof", "static", "struct",
+    "switch", "template", "this", "throw", "try", "typedef", "typename",
+    "union", "using", "virtual", "volatile", "while", 0,
+  };
+
+  static const char *types[] = {
+    "bool", "char", "double", "float", "int", "long", "short", "signed",
+    "unsigned", "void", "wchar_t", "size_t", "ssize_t",
+    "int8_t", "int16_t", "int32_t", "int64_t",
+    "uint8_t", "uint16_t", "uint32_t", "uint64_t",
+    "u8", "u16", "u32", "u64", "s8", "s16", "s32", "s64",
+    "b8", "r32", "r64", 0,
+  };
+
+  keyword_table_insert (keywords, CELL_ATTR_KEYWORD);
+  keyword_table_insert (types, CELL_ATTR_TYPE);
+  keyword_table_ready = 1;
+}
+
+
+// Longest word in the table ("constexpr", "protected", ...).
+#define KEYWORD_LENGTH_MAX 9
+
+
+// CELL_ATTR_IDENTIFIER unless the token is a known keyword or type.
+static CellAttr
+keyword_classify (const char *p, size_t length)
+{
+  if (length < 2 || length > KEYWORD_LENGTH_MAX)
+    {
+      return CELL_ATTR_IDENTIFIER;
+    }
+
+  KeywordSlot *slot = &keyword_table[keyword_hash (p, length)];
+
+  if (slot->word && slot->length == length &&
+      !memcmp (slot->word, p, length))
+    {
+      return (CellAttr) slot->attr;
+    }
+
+  return CELL_ATTR_IDENTIFIER;
+}
+
+
+static char *
+parse_identifier (char *p, char *end, RowWriter *row)
+{
+  char *stop = scan_identifier (p);
+  if (stop > end) stop = end;
+  row_set_attr (row, keyword_classify (p, stop - p));
+  row_put (row, p, stop - p);
+  return stop;
+}
+
+
+/* One pass over a numeric literal: the vector kernel eats the plain
+ * digit run, then the class table mops up hex/octal/binary bodies,
+ * radix points, exponents and suffixes one table load per byte.  A
+ * sign belongs to the number only right after an exponent letter.
+ */
+static char *
+parse_num (char *p, char *end, RowWriter *row)
+{
+  char *start = p;
+
+  p = scan_num (p);
+  if (p > end) p = end;
+
+  while (p < end && (char_class[(u8) *p] & CHAR_CLASS_NUMBER))
+    {
+      char c = *p++;
+
+      if ((c == 'e' || c == 'E' || c == 'p' || c == 'P') &&
+          p < end && (*p == '+' || *p == '-'))
+        {
+          ++p;
+        }
+    }
+
+  row_put (row, start, p - start);
+  return p;
+}
+
+
+/* Incremental highlighting.  contexts[i] is the parser context the
+ * highlighter is in when it enters line i, so after an edit only the
+ * damaged line needs re-parsing, continuing into following lines only
+ * while their recorded entry context changed (e.g. an opened or
+ * closed block comment).
+ */
+struct HighlightState {
+  TextContext *contexts;
+  size_t count;
+  size_t size;
+  Arena *arena;
+};
+
+
+static HighlightState
+new_highlight_state (Arena *arena)
+{
+  HighlightState state;
+  char_class_init ();     // both tables before any worker thread parses
+  keyword_table_init ();
+  state.arena = arena;
+  state.size = 64;
+  state.contexts = (TextContext *) arena_alloc (arena,
+                                                state.size * sizeof (TextContext));
+  state.count = 0;
+  return state;
+}
+
+
+static void
+highlight_state_reserve (HighlightState *state, size_t count)
+{
+  if (state->count + count <= state->size) return;
+
+  while (state->count + count > state->size)
+    {
+      state->size *= 2;
+    }
+
+  TextContext *contexts =
+    (TextContext *) arena_alloc (state->arena,
+                                 state->size * sizeof (TextContext));
+  memcpy (contexts, state->contexts, state->count * sizeof (TextContext));
+  state->contexts = contexts;
+}
+
+
+static void
+highlight_state_insert_lines (HighlightState *state, size_t line, size_t count)
+{
+  highlight_state_reserve (state, count);
+  memmove (state->contexts + line + count,
+           state->contexts + line,
+           (state->count - line) * sizeof (TextContext));
+  state->count += count;
+}
+
+
+static void
+highlight_state_delete_lines (HighlightState *state, size_t line, size_t count)
+{
+  memmove (state->contexts + line,
+           state->contexts + line + count,
+           (state->count - line - count) * sizeof (TextContext));
+  state->count -= count;
+}
+
+
+/* Parses one line starting in the given context, paints its
+ * highlighted cells into row (0 to only recompute contexts) and
+ * returns the context the next line is entered in.  The parsed region
+ * includes the terminating newline; a "*" / "/" pair can never
+ * straddle it, so block comment closings stay within one region.
+ */
+static TextContext
+highlight_line (Buffer *buffer, LineIndex *index, size_t line,
+                TextContext context, RowWriter *row)
+{
+  size_t start = index->offsets[line];
+  size_t line_length = line_index_line_length (index, buffer, line);
+  size_t text_length = buffer->used ? buffer->used - 1 : 0;
+  size_t region_length = line_length;
+  if (start + line_length < text_length) ++region_length;  // the newline
+
+  size_t span_length;
+  char *p = buffer_span (buffer, start, &span_length);
+
+  if (span_length < region_length)
+    {
+      // The line straddles the gap - copy it contiguous.  Thread-local
+      // because the parallel rebuild parses chunks concurrently.
+      static __thread Buffer scratch = {};
+      if (scratch.size < region_length + 1)
+        {
+          free (scratch.data);
+          scratch = new_buffer (region_length + 1);
+        }
+
+      memcpy (scratch.data, p, span_length);
+      size_t tail_length;
+      char *tail = buffer_span (buffer, start + span_length, &tail_length);
+      memcpy (scratch.data + span_length, tail, region_length - span_length);
+      scratch.data[region_length] = 0;
+      p = scratch.data;
+    }
+
+  char *end = p + region_length;
+
+  // Re-enter the carried attribute so a row can be drawn in isolation.
+  if (context.type == TEXT_CONTEXT_BLOCK_COMMENT)
+    {
+      row_set_attr (row, CELL_ATTR_COMMENT);
+    }
+  else if (context.type == TEXT_CONTEXT_INLINE_COMMENT)
+    {
+      row_set_attr (row, CELL_ATTR_INLINE_COMMENT);
+    }
+  else if (context.type == TEXT_CONTEXT_STRING_LITERAL)
+    {
+      row_set_attr (row, CELL_ATTR_STRING);
+    }
+
+  while (p < end)
+    {
+      if (context.type == TEXT_CONTEXT_BLOCK_COMMENT)
+        {
+          char *p0 = p;
+          p = parse_block_comment (p, end, row);
+
+          if (p < end ||
+              (p - p0 >= 2 && p[-2] == '*' && p[-1] == '/'))
+            {
+              row_set_attr (row, CELL_ATTR_PLAIN);
+              context.type = TEXT_CONTEXT_GLOBAL;
+            }
+        }
+      else if (context.type == TEXT_CONTEXT_INLINE_COMMENT)
+        {
+          p = parse_inline_comment (p, end, row);
+
+          if (p < end)  // stopped at the line break, not at end of file
+            {
+              row_set_attr (row, CELL_ATTR_PLAIN);
+              context.type = TEXT_CONTEXT_GLOBAL;
+            }
+        }
+      else if (context.type == TEXT_CONTEXT_STRING_LITERAL)
+        {
+          char *p0 = p;
+          p = parse_string_literal (p, end, row);
+
+          if (p < end ||
+              (p > p0 && p[-1] == '"' &&
+               (p - 1 == p0 || p[-2] != '\\')))
+            {
+              row_set_attr (row, CELL_ATTR_PLAIN);
+              context.type = TEXT_CONTEXT_GLOBAL;
+            }
+        }
+      else if (context.type == TEXT_CONTEXT_CHAR_LITERAL)
+        {
+          char *p0 = p;
+          p = parse_char_literal (p, end, row);
+
+          if (p < end || (p > p0 && p[-1] == '\''))
+            {
+              row_set_attr (row, CELL_ATTR_PLAIN);
+              context.type = TEXT_CONTEXT_GLOBAL;
+            }
+        }
+      else
+        {
+          char c = *p;
+          char next = (p + 1 < end) ? p[1] : 0;
+          u8 char_flags = char_class[(u8) c];
+
+          if (char_flags & CHAR_CLASS_SPACE)
+            {
+              p = parse_space (p, end, row);
+            }
+          else if (c == '/' && next == '*')
+            {
+              row_set_attr (row, CELL_ATTR_COMMENT);
+              row_put (row, p, 2);
+              p += 2;
+              context.type = TEXT_CONTEXT_BLOCK_COMMENT;
+            }
+          else if (c == '/' && next == '/')
+            {
+              row_set_attr (row, CELL_ATTR_INLINE_COMMENT);
+              context.type = TEXT_CONTEXT_INLINE_COMMENT;
+            }
+          else if (c == '"')
+            {
+              row_set_attr (row, CELL_ATTR_STRING);
+              row_put_char (row, c);
+              ++p;
+              context.type = TEXT_CONTEXT_STRING_LITERAL;
+            }
+          else if (c == '\'')
+            {
+              row_set_attr (row, CELL_ATTR_STRING);
+              row_put_char (row, c);
+              ++p;
+              context.type = TEXT_CONTEXT_CHAR_LITERAL;
+            }
+          else if (c == '(' || c == ')' ||
+                   c == '{' || c == '}' ||
+                   c == '[' || c == ']' ||
+                   c == '=' ||
+                   c == ',' ||
+                   c == ';' ||
+                   c == '*' ||
+                   c == '&' ||
+                   c == '/')
+            {
+              row_put_char (row, c);
+              ++p;
+            }
+          else if (char_flags & CHAR_CLASS_IDENT_0)
+            {
+              p = parse_identifier (p, end, row);
+              row_set_attr (row, CELL_ATTR_PLAIN);
+            }
+          else if (char_flags & CHAR_CLASS_DIGIT)
+            {
+              p = parse_num (p, end, row);
+            }
+          else if (c & 0x80)
+            {
+              // One cell per multibyte character.
+              u32 codepoint;
+              size_t char_length = utf8_decode (p, end, &codepoint);
+              row_put (row, p, char_length);
+              p += char_length;
+            }
+          else
+            {
+              // Bytes the parser has no class for paint as-is.
+              row_put_char (row, c);
+              ++p;
+            }
+        }
+    }
+
+  return context;
+}
+
+
+// Buffers smaller than this are parsed on one core - thread startup
+// would cost more than the parse.
+#define PARALLEL_HIGHLIGHT_THRESHOLD (4u << 20)
+
+#define PARALLEL_HIGHLIGHT_MAX_THREADS 16
+
+struct HighlightChunk {
+  Buffer *buffer;
+  LineIndex *index;
+  HighlightState *state;
+  size_t first_line;
+  size_t line_count;
+  TextContext exit_context;
+};
+
+
+/* Speculatively parses one chunk of lines assuming it starts in the
+ * global context, recording per-line entry contexts under that
+ * assumption.  The fix-up pass in highlight_rebuild repairs chunks
+ * whose real entry context (a block comment or string literal
+ * spanning the chunk boundary) turns out different.
+ */
+static void *
+highlight_chunk_worker (void *arg)
+{
+  HighlightChunk *chunk = (HighlightChunk *) arg;
+
+  TextContext context;
+  context.type = TEXT_CONTEXT_GLOBAL;
+  context.length = 0;
+
+  for (size_t i = 0; i < chunk->line_count; ++i)
+    {
+      size_t line = chunk->first_line + i;
+      chunk->state->contexts[line] = context;
+      context = highlight_line (chunk->buffer, chunk->index, line,
+                                context, 0);
+    }
+
+  chunk->exit_context = context;
+  return 0;
+}
+
+
+// Records every line's entry context by parsing the whole buffer,
+// splitting the work across cores for large files.
+static void
+highlight_rebuild (HighlightState *state, Buffer *buffer, LineIndex *index)
+{
+  state->count = 0;
+  highlight_state_reserve (state, index->count);
+  state->count = index->count;
+
+  size_t text_length = buffer->used ? buffer->used - 1 : 0;
+
+  size_t thread_count = sysconf (_SC_NPROCESSORS_ONLN);
+  if (thread_count > PARALLEL_HIGHLIGHT_MAX_THREADS)
+    {
+      thread_count = PARALLEL_HIGHLIGHT_MAX_THREADS;
+    }
+
+  if (text_length < PARALLEL_HIGHLIGHT_THRESHOLD ||
+      thread_count < 2 ||
+      index->count < thread_count * 64)
+    {
+      TextContext context;
+      context.type = TEXT_CONTEXT_GLOBAL;
+      context.length = 0;
+
+      for (size_t line = 0; line < index->count; ++line)
+        {
+          state->contexts[line] = context;
+          context = highlight_line (buffer, index, line, context, 0);
+        }
+
+      return;
+    }
+
+  HighlightChunk chunks[PARALLEL_HIGHLIGHT_MAX_THREADS];
+  pthread_t threads[PARALLEL_HIGHLIGHT_MAX_THREADS];
+
+  size_t lines_per_chunk = index->count / thread_count;
+
+  for (size_t c = 0; c < thread_count; ++c)
+    {
+      chunks[c].buffer = buffer;
+      chunks[c].index = index;
+      chunks[c].state = state;
+      chunks[c].first_line = c * lines_per_chunk;
+      chunks[c].line_count = (c + 1 == thread_count)
+        ? index->count - chunks[c].first_line
+        : lines_per_chunk;
+    }
+
+  for (size_t c = 1; c < thread_count; ++c)
+    {
+      int create_error = pthread_create (&threads[c], 0,
+                                         highlight_chunk_worker, &chunks[c]);
+      assert (!create_error);
+    }
+
+  highlight_chunk_worker (&chunks[0]);
+
+  for (size_t c = 1; c < thread_count; ++c)
+    {
+      pthread_join (threads[c], 0);
+    }
+
+  /* Fix-up: chunk 0's speculative global entry is the real one.  A
+   * later chunk whose real entry context differs gets re-parsed until
+   * its recorded contexts converge with the corrected ones - the
+   * re-parse typically stops at the end of the spanning construct.
+   */
+  TextContext context = chunks[0].exit_context;
+
+  for (size_t c = 1; c < thread_count; ++c)
+    {
+      HighlightChunk *chunk = &chunks[c];
+
+      if (context.type == TEXT_CONTEXT_GLOBAL)
+        {
+          context = chunk->exit_context;
+          continue;
+        }
+
+      b8 converged = 0;
+
+      for (size_t i = 0; i < chunk->line_count; ++i)
+        {
+          size_t line = chunk->first_line + i;
+
+          if (state->contexts[line].type == context.type)
+            {
+              converged = 1;
+              break;
+            }
+
+          state->contexts[line] = context;
+          context = highlight_line (buffer, index, line, context, 0);
+        }
+
+      if (converged)
+        {
+          context = chunk->exit_context;
+        }
+    }
+}
+
+
+/* Re-parses from the edited line onwards, stopping as soon as a
+ * following line's recorded entry context is reproduced - the damage
+ * cannot propagate past that point.  The fresh_count slots after line
+ * were just inserted and hold whatever the arena held before, so the
+ * convergence test is suppressed until the scan is past them: a stale
+ * byte that happened to match would otherwise strand the inserted
+ * lines with garbage contexts.
+ */
+static void
+highlight_update (HighlightState *state, Buffer *buffer, LineIndex *index,
+                  size_t line, size_t fresh_count)
+{
+  assert (state->count == index->count);
+
+  TextContext context = state->contexts[line];
+
+  for (size_t i = line; i < index->count; ++i)
+    {
+      context = highlight_line (buffer, index, i, context, 0);
+
+      if (i + 1 < index->count)
+        {
+          if (i + 1 > line + fresh_count &&
+              state->contexts[i + 1].type == context.type)
+            {
+              break;
+            }
+          state->contexts[i + 1] = context;
+        }
+    }
+}
+
+
+/* Applies an edit to the buffer and keeps the line index and the
+ * highlight contexts in sync.  The keystroke handlers and the undo
+ * journal below route every mutation through these two.
+ */
+static void
+edit_insert (Buffer *buffer, LineIndex *index, HighlightState *highlight,
+             size_t offset, const char *text, size_t length)
+{
+  size_t old_count = index->count;
+  size_t edit_line = line_index_find (index, offset);
+
+  buffer_insert_at (buffer, offset, text, length);
+  line_index_insert (index, buffer, offset, length);
+
+  if (index->count > old_count)
+    {
+      highlight_state_insert_lines (highlight, edit_line + 1,
+                                    index->count - old_count);
+    }
+
+  highlight_update (highlight, buffer, index, edit_line,
+                    index->count - old_count);
+}
+
+
+static void
+edit_delete (Buffer *buffer, LineIndex *index, HighlightState *highlight,
+             size_t offset, size_t length)
+{
+  size_t old_count = index->count;
+
+  line_index_delete (index, offset, length);
+  buffer_delete_range (buffer, offset, length);
+
+  size_t edit_line = line_index_find (index, offset);
+
+  if (old_count > index->count)
+    {
+      highlight_state_delete_lines (highlight, edit_line + 1,
+                                    old_count - index->count);
+    }
+
+  highlight_update (highlight, buffer, index, edit_line, 0);
+}
+
+
+/* Undo/redo journal.  Every edit appends a compact record - an offset
+ * plus the span of text inserted or removed - into arena-backed
+ * storage, so undo depth costs bytes per edit instead of a buffer
+ * snapshot per keystroke.  Records before cursor are applied to the
+ * buffer; undo steps cursor back, redo forward, and a fresh edit after
+ * undos drops the redo tail.  Adjacent single-character typing merges
+ * into the previous record so a burst of typing undoes as a unit.
+ */
+#define UNDO_COALESCE_MAX 32
+
+enum UndoKind {
+  UNDO_INSERT,
+  UNDO_DELETE,
+};
+
+struct UndoRecord {
+  size_t offset;
+  size_t length;
+  char *text;
+  UndoKind kind;
+};
+
+struct UndoJournal {
+  UndoRecord *records;
+  size_t count;
+  size_t size;
+  size_t cursor;
+  Arena *arena;
+};
+
+
+static UndoJournal
+new_undo_journal (Arena *arena)
+{
+  UndoJournal journal;
+  journal.arena = arena;
+  journal.size = 64;
+  journal.records =
+    (UndoRecord *) arena_alloc (arena, journal.size * sizeof (UndoRecord));
+  journal.count = 0;
+  journal.cursor = 0;
+  return journal;
+}
+
+
+static UndoRecord *
+undo_append (UndoJournal *journal, UndoKind kind, size_t offset,
+             const char *text, size_t length)
+{
+  journal->count = journal->cursor;  // a new edit kills the redo tail
+
+  if (journal->count == journal->size)
+    {
+      journal->size *= 2;
+      UndoRecord *records =
+        (UndoRecord *) arena_alloc (journal->arena,
+                                    journal->size * sizeof (UndoRecord));
+      memcpy (records, journal->records,
+              journal->count * sizeof (UndoRecord));
+      journal->records = records;
+    }
+
+  UndoRecord *record = &journal->records[journal->count++];
+  journal->cursor = journal->count;
+
+  record->kind = kind;
+  record->offset = offset;
+  record->length = length;
+  record->text = (char *) arena_alloc (journal->arena, length);
+  memcpy (record->text, text, length);
+  return record;
+}
+
+
+/* Printable characters typed back to back extend the previous record,
+ * capped so one undo doesn't swallow a paragraph.
+ */
+static void
+undo_record_insert (UndoJournal *journal, size_t offset,
+                    const char *text, size_t length)
+{
+  if (length == 1 && text[0] != '\n' &&
+      journal->count && journal->cursor == journal->count)
+    {
+      UndoRecord *last = &journal->records[journal->count - 1];
+
+      if (last->kind == UNDO_INSERT &&
+          last->length < UNDO_COALESCE_MAX &&
+          offset == last->offset + last->length)
+        {
+          char *merged = (char *) arena_alloc (journal->arena,
+                                               last->length + 1);
+          memcpy (merged, last->text, last->length);
+          merged[last->length] = text[0];
+          last->text = merged;
+          ++last->length;
+          return;
+        }
+    }
+
+  undo_append (journal, UNDO_INSERT, offset, text, length);
+}
+
+
+static void
+undo_record_delete (UndoJournal *journal, size_t offset,
+                    const char *text, size_t length)
+{
+  undo_append (journal, UNDO_DELETE, offset, text, length);
+}
+
+
+// Returns the offset the cursor should land on, or (size_t) -1 when
+// there is nothing to undo.
+static size_t
+undo_apply (UndoJournal *journal, Buffer *buffer, LineIndex *index,
+            HighlightState *highlight)
+{
+  if (journal->cursor == 0) return (size_t) -1;
+
+  UndoRecord *record = &journal->records[--journal->cursor];
+
+  if (record->kind == UNDO_INSERT)
+    {
+      edit_delete (buffer, index, highlight, record->offset, record->length);
+      return record->offset;
+    }
+
+  edit_insert (buffer, index, highlight, record->offset,
+               record->text, record->length);
+  return record->offset + record->length;
+}
+
+
+static size_t
+redo_apply (UndoJournal *journal, Buffer *buffer, LineIndex *index,
+            HighlightState *highlight)
+{
+  if (journal->cursor == journal->count) return (size_t) -1;
+
+  UndoRecord *record = &journal->records[journal->cursor++];
+
+  if (record->kind == UNDO_INSERT)
+    {
+      edit_insert (buffer, index, highlight, record->offset,
+                   record->text, record->length);
+      return record->offset + record->length;
+    }
+
+  edit_delete (buffer, index, highlight, record->offset, record->length);
+  return record->offset;
+}
+
+
+/* Substring search.  The scan uses memchr for the pattern's first byte
+ * and memcmp to verify the rest - both vectorized in libc, so it runs
+ * at memory bandwidth.  search_step scans one bounded slice at a time
+ * from the event loop between keystrokes, so a find over a gigabyte
+ * never freezes the UI; match offsets stream into a sorted arena-backed
+ * array, making next/previous navigation a binary search and the
+ * status line match count a field read.
+ */
+#define SEARCH_STEP_SIZE (16u << 20)
+#define SEARCH_PATTERN_MAX 64
+
+struct Search {
+  char pattern[SEARCH_PATTERN_MAX];
+  size_t pattern_length;
+  size_t *matches;
+  size_t count;
+  size_t size;
+  size_t scan_at;    // Next text offset to consider as a match start
+  u64 generation;    // Buffer generation the matches were scanned from
+  b8 active;
+  b8 entering;       // The status line owns keystrokes (pattern entry)
+  b8 done;
+  Arena *arena;
+};
+
+
+static Search
+new_search (Arena *arena)
+{
+  Search search;
+  search.arena = arena;
+  search.pattern[0] = 0;
+  search.pattern_length = 0;
+  search.size = 64;
+  search.matches = (size_t *) arena_alloc (arena, search.size * sizeof (size_t));
+  search.count = 0;
+  search.scan_at = 0;
+  search.generation = 0;
+  search.active = 0;
+  search.entering = 0;
+  search.done = 0;
+  return search;
+}
+
+
+static void
+search_restart (Search *search, Buffer *buffer)
+{
+  search->count = 0;
+  search->scan_at = 0;
+  search->generation = buffer->generation;
+  search->done = 0;
+}
+
+
+static void
+search_push (Search *search, size_t offset)
+{
+  if (search->count == search->size)
+    {
+      search->size *= 2;
+      size_t *matches = (size_t *) arena_alloc (search->arena,
+                                                search->size * sizeof (size_t));
+      memcpy (matches, search->matches, search->count * sizeof (size_t));
+      search->matches = matches;
+    }
+
+  search->matches[search->count++] = offset;
+}
+
+
+// Fast path over a contiguous run: base is the text offset of span[0]
+// and every match fits inside the span.
+static void
+search_scan_span (Search *search, char *span, size_t span_length, size_t base)
+{
+  char *p = span;
+  char *stop = span + span_length - search->pattern_length + 1;
+
+  while (p < stop)
+    {
+      char *hit = (char *) memchr (p, search->pattern[0], stop - p);
+      if (!hit) break;
+
+      if (!memcmp (hit, search->pattern, search->pattern_length))
+        {
+          search_push (search, base + (hit - span));
+        }
+
+      p = hit + 1;
+    }
+}
+
+
+// Byte-wise check used only for the few starts straddling the gap.
+static b8
+search_match_at (Search *search, Buffer *buffer, size_t offset)
+{
+  for (size_t i = 0; i < search->pattern_length; ++i)
+    {
+      if (buffer_char_at (buffer, offset + i) != search->pattern[i])
+        {
+          return 0;
+        }
+    }
+
+  return 1;
+}
+
+
+// Scans one slice; returns nonzero while more of the buffer remains.
+static b8
+search_step (Search *search, Buffer *buffer)
+{
+  size_t text_length = buffer->used ? buffer->used - 1 : 0;
+
+  if (search->pattern_length == 0 || text_length < search->pattern_length)
+    {
+      search->scan_at = text_length;
+      search->done = 1;
+      return 0;
+    }
+
+  // One past the last text offset a match can start at.
+  size_t limit = text_length - search->pattern_length + 1;
+
+  size_t end = search->scan_at + SEARCH_STEP_SIZE < limit
+             ? search->scan_at + SEARCH_STEP_SIZE : limit;
+
+  while (search->scan_at < end)
+    {
+      if (search->scan_at < buffer->gap_start)
+        {
+          // Starts fitting wholly before the gap take the fast path;
+          // the up to pattern_length - 1 starts whose match would
+          // straddle the gap are checked byte-wise.
+          size_t straddle = buffer->gap_start < search->pattern_length
+                          ? 0 : buffer->gap_start - search->pattern_length + 1;
+          size_t span_end = straddle < end ? straddle : end;
+
+          if (search->scan_at < span_end)
+            {
+              size_t span_length;
+              char *span = buffer_span (buffer, search->scan_at, &span_length);
+              search_scan_span (search, span,
+                                span_end - search->scan_at +
+                                search->pattern_length - 1,
+                                search->scan_at);
+              search->scan_at = span_end;
+            }
+
+          while (search->scan_at < end &&
+                 search->scan_at < buffer->gap_start)
+            {
+              if (search_match_at (search, buffer, search->scan_at))
+                {
+                  search_push (search, search->scan_at);
+                }
+              ++search->scan_at;
+            }
+        }
+      else
+        {
+          // At or past the gap the rest of the text is one run.
+          size_t span_length;
+          char *span = buffer_span (buffer, search->scan_at, &span_length);
+          search_scan_span (search, span,
+                            end - search->scan_at +
+                            search->pattern_length - 1,
+                            search->scan_at);
+          search->scan_at = end;
+        }
+    }
+
+  search->done = search->scan_at >= limit;
+  return !search->done;
+}
+
+
+// First match at or after from, wrapping; (size_t) -1 without matches.
+static size_t
+search_next (Search *search, size_t from)
+{
+  if (search->count == 0) return (size_t) -1;
+
+  size_t lo = 0;
+  size_t hi = search->count;
+
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (search->matches[mid] < from) lo = mid + 1;
+      else                             hi = mid;
+    }
+
+  return lo < search->count ? search->matches[lo] : search->matches[0];
+}
+
+
+// Last match before from, wrapping.
+static size_t
+search_prev (Search *search, size_t from)
+{
+  if (search->count == 0) return (size_t) -1;
+
+  size_t lo = 0;
+  size_t hi = search->count;
+
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (search->matches[mid] < from) lo = mid + 1;
+      else                             hi = mid;
+    }
+
+  return lo ? search->matches[lo - 1] : search->matches[search->count - 1];
+}
+
+
+static void
+u64_to_str (u64 num, char *out)
+{
+  if (num == 0)
+    {
+      out[0] = '0';
+      out[1] = 0;
+      return;
+    }
+
+  char *end = out;
+
+  while (num > 0)
+    {
+      u64 new_num = num / 10;
+      char digit = num - new_num * 10;
+      *(end++) = digit + '0';
+      num = new_num;
+    }
+
+  *(end--) = 0;
+
+  while (out < end)
+    {
+      char tmp = *out;
+      *(out++) = *end;
+      *(end--) = tmp;
+    }
+}
+
+
+static void
+s64_to_str (s64 num, char *out)
+{
+  if (num < 0)
+    {
+      *(out++) = '-';
+      num = -num;
+    }
+
+  u64_to_str (num, out);
+}
+
+
+static r64
+now_seconds (void)
+{
+  timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* Perf HUD.  Wall time of the render and flush phases, how long the
+ * frame waited for and then processed input, and the bytes and
+ * write() calls the frame issued.  ^T renders the previous frame's
+ * numbers into the status line; setting TTE_TRACE=path additionally
+ * appends one binary FrameStats record per frame for offline
+ * analysis.  This is how "it lags over SSH" gets split into parse
+ * time vs formatting vs terminal I/O.
+ */
+struct FrameStats {
+  r64 render_seconds;
+  r64 flush_seconds;
+  r64 input_wait_seconds;
+  r64 input_process_seconds;
+  u64 bytes_written;
+  u64 write_calls;
+};
+
+
+static int
+trace_begin (void)
+{
+  const char *path = getenv ("TTE_TRACE");
+  if (!path) return -1;
+
+  int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  assert (fd != -1);
+  return fd;
+}
+
+
+static void
+trace_frame (int fd, FrameStats *stats)
+{
+  if (fd == -1) return;
+  write (fd, stats, sizeof *stats);
+}
+
+
+/* Display-column tracking.  The cursor's x is a byte offset into its
+ * line; the display column differs as soon as tabs are involved, and
+ * recomputing it by scanning a 500k-character line from the start on
+ * every lateral move would make long lines unusable.  The cache
+ * remembers the last conversion: stepping right extends it in O(1)
+ * and stepping left walks backwards, falling back to a rescan only
+ * when it crosses a tab (whose width depends on what precedes it).
+ */
+struct ColumnCache {
+  u64 generation;
+  size_t line;
+  size_t offset;  // Byte offset within the line
+  size_t column;  // Display column at that offset
+};
+
+
+static size_t
+display_column (ColumnCache *cache, Buffer *buffer, LineIndex *index,
+                size_t line, size_t offset)
+{
+  size_t line_start = index->offsets[line];
+  size_t from = 0;
+  size_t column = 0;
+
+  if (cache->generation == buffer->generation && cache->line == line)
+    {
+      if (cache->offset <= offset)
+        {
+          from = cache->offset;
+          column = cache->column;
+        }
+      else
+        {
+          from = cache->offset;
+          column = cache->column;
+
+          while (from > offset &&
+                 buffer_char_at (buffer, line_start + from - 1) != '\t')
+            {
+              if (!is_utf8_continuation (buffer_char_at (buffer,
+                                                         line_start + from - 1)))
+                {
+                  --column;
+                }
+              --from;
+            }
+
+          if (from > offset)  // hit a tab - count from the line start
+            {
+              from = 0;
+              column = 0;
+            }
+        }
+    }
+
+  for (size_t i = from; i < offset; ++i)
+    {
+      char c = buffer_char_at (buffer, line_start + i);
+
+      if (c == '\t')
+        {
+          column = (column / 8 + 1) * 8;
+        }
+      else if (!is_utf8_continuation (c))
+        {
+          ++column;
+        }
+    }
+
+  cache->generation = buffer->generation;
+  cache->line = line;
+  cache->offset = offset;
+  cache->column = column;
+  return column;
+}
+
+
+/* The visible window into the buffer.  Rendering draws exactly rows
+ * lines starting at top_line each frame instead of emitting the whole
+ * file; left_col scrolls the window sideways so only the visible
+ * column range of a long line is ever painted.  The last terminal row
+ * is reserved for the status line.
+ */
+struct Viewport {
+  size_t top_line;
+  size_t left_col;
+  u16 rows;
+  u16 cols;
+};
+
+
+static void
+render_viewport (Viewport *viewport, Buffer *buffer, LineIndex *index,
+                 HighlightState *highlight, Screen *screen)
+{
+  for (u16 r = 0; r < viewport->rows; ++r)
+    {
+      RowWriter row;
+      row.cells = screen->back + (size_t) r * screen->cols;
+      row.pos = 0;
+      row.left = viewport->left_col;
+      row.cols = screen->cols;
+      row.col = 0;
+      row.attr = CELL_ATTR_PLAIN;
+
+      size_t line = viewport->top_line + r;
+      if (line < index->count)
+        {
+          highlight_line (buffer, index, line,
+                          highlight->contexts[line], &row);
+        }
+
+      while (row.col < row.cols)
+        {
+          row.cells[row.col].cp = ' ';
+          row.cells[row.col].attr = CELL_ATTR_PLAIN;
+          ++row.col;
+        }
+    }
+}
+
+
+/* Status line.  The bottom row is composed of cached segments -
+ * document, geometry, cursor position, message - each re-formatted
+ * only when its inputs change.  The bar repaints more often than
+ * anything else in the editor; a frame with an unchanged status now
+ * costs a few compares and touches no cells (terminal emission was
+ * already per-column through the cell diff in screen_flush).  The
+ * HUD shows per-frame numbers and so repaints every frame while
+ * enabled.
+ */
+struct StatusLine {
+  char document_text[300];
+  char geometry_text[32];
+  char cursor_text[48];
+  char message_text[700];
+  size_t document;      // 1-based; 0 forces the first format
+  u16 ws_rows;
+  u16 ws_cols;
+  size_t line;
+  size_t column;
+  b8 dirty;
+};
+
+
+static StatusLine
+new_status_line (void)
+{
+  StatusLine status;
+  memset (&status, 0, sizeof (status));
+  status.dirty = 1;
+  return status;
+}
+
+
+static void
+status_set_message (StatusLine *status, const char *message)
+{
+  if (!strcmp (status->message_text, message)) return;
+
+  size_t length = strlen (message);
+  if (length >= sizeof (status->message_text))
+    {
+      length = sizeof (status->message_text) - 1;
+    }
+  memcpy (status->message_text, message, length);
+  status->message_text[length] = 0;
+  status->dirty = 1;
+}
+
+
+// Re-formats the segments whose inputs changed since the last frame.
+static void
+status_update (StatusLine *status, size_t document, size_t document_count,
+               const char *path, u16 ws_cols, u16 ws_rows,
+               size_t line, size_t column)
+{
+  if (status->document != document + 1)
+    {
+      sprintf (status->document_text, "[%lu/%lu %.256s]",
+               document + 1, document_count, path ? path : "(scratch)");
+      status->document = document + 1;
+      status->dirty = 1;
+    }
+
+  if (status->ws_cols != ws_cols || status->ws_rows != ws_rows)
+    {
+      sprintf (status->geometry_text, " Size: %ux%u;", ws_cols, ws_rows);
+      status->ws_cols = ws_cols;
+      status->ws_rows = ws_rows;
+      status->dirty = 1;
+    }
+
+  if (status->line != line || status->column != column)
+    {
+      sprintf (status->cursor_text, " L%lu C%lu; ", line, column);
+      status->line = line;
+      status->column = column;
+      status->dirty = 1;
+    }
+}
+
+
+/* Terminal profiles.  Capabilities live in a static table selected
+ * once at startup by TERM prefix, so supporting a terminal is one
+ * table row, not another strcmp chain.  The whole entry and restore
+ * sequences are single strings emitted with one write() each instead
+ * of a syscall per escape.  xterm keeps the legacy 47 alternate
+ * screen it has always been driven with; the multiplexers and
+ * alacritty take 1049, which saves and restores the cursor itself.
+ */
+struct TerminalProfile {
+  const char *name;       // TERM prefix to match
+  const char *enter;      // written once by init_screen
+  const char *restore;    // written once by destroy_screen
+  u16 color_depth;        // colors the terminal can show
+  b8 scroll_region;       // supports \e[r with \e[S/\e[T
+};
+
+static const TerminalProfile terminal_profiles[] = {
+  {"xterm",     "\e7\e[?47h\e[?7l\e[?2004h",
+                "\e[?2004l\e[?7h\e[?47l\e8",   16, 1},
+  {"screen",    "\e[?1049h\e[?7l\e[?2004h",
+                "\e[?2004l\e[?7h\e[?1049l",   16, 1},
+  {"tmux",      "\e[?1049h\e[?7l\e[?2004h",
+                "\e[?2004l\e[?7h\e[?1049l",  256, 1},
+  {"alacritty", "\e[?1049h\e[?7l\e[?2004h",
+                "\e[?2004l\e[?7h\e[?1049l",  256, 1},
+  {"rxvt",      "\e7\e[?47h\e[?7l\e[?2004h",
+                "\e[?2004l\e[?7h\e[?47l\e8",   16, 1},
+  {"linux",     "\e[?7l",  "\e[?7h",            16, 0},
+};
+
+
+static const TerminalProfile *
+init (char *exec_path)
+{
+  char *term = getenv ("TERM");
+
+  if (!term)
+    {
+      write (2, exec_path, strlen (exec_path));
+      write (2, STR (": The environment variable TERM isn't set "
+                     "- it should be set to `xterm'.\n"));
+      return 0;
+    }
+
+  for (size_t i = 0;
+       i < sizeof (terminal_profiles) / sizeof (*terminal_profiles);
+       ++i)
+    {
+      const TerminalProfile *profile = &terminal_profiles[i];
+
+      // "xterm-256color" and friends match their base entry.
+      if (!strncmp (term, profile->name, strlen (profile->name)))
+        {
+          return profile;
+        }
+    }
+
+  write (2, exec_path, strlen (exec_path));
+  write (2, STR (": The environment variable TERM is set to `"));
+  write (2, term, strlen (term));
+  write (2, STR ("' - no terminal profile matches it.\n"));
+  return 0;
+}
+
+
+static termios
+init_screen (const TerminalProfile *profile)
+{
+  write (1, profile->enter, strlen (profile->enter));
+
+  termios original_terminal_attributes;
+  int tcgetattr_error = tcgetattr (0, &original_terminal_attributes);
+  assert (!tcgetattr_error);
+  termios terminal_attributes = original_terminal_attributes;
+  terminal_attributes.c_lflag &= ~ICANON; // Immediate input
+  terminal_attributes.c_lflag &= ~ECHO;   // Don't echo characters
+  terminal_attributes.c_iflag &= ~IXON;   // Disable ^s and ^q
+  int tcsetattr_error = tcsetattr (0, TCSANOW, &terminal_attributes);
+  assert (!tcsetattr_error);
+
+  return original_terminal_attributes;
+}
+
+
+static void
+destroy_screen (termios original_terminal_attributes,
+                const TerminalProfile *profile)
+{
+  int tcsetattr_error = tcsetattr (0, TCSADRAIN, &original_terminal_attributes);
+  assert (!tcsetattr_error);
+
+  write (1, profile->restore, strlen (profile->restore));
+}
+
+
+/* Escape input decoder.  Keyboard escape sequences arrive as \e[
+ * (CSI) or \eO (SS3) prefixes followed by parameter digits and a
+ * final byte, and read() can split one anywhere.  The decoder is a
+ * four-state machine driven by static tables - a byte class table
+ * and a state transition table with the action packed into the high
+ * nibble - so a byte costs two array lookups no matter how many keys
+ * are bound, and a sequence split across reads just leaves the state
+ * parked until the rest arrives.  Completed sequences resolve through
+ * a binding table covering the xterm repertoire, the keys the editor
+ * leaves unbound included, so unknown input is swallowed instead of
+ * hitting the assert the old exact-3-byte switch killed the session
+ * with.
+ */
+enum Key {
+  KEY_NONE,     // mid-sequence - nothing complete yet
+  KEY_IGNORED,  // complete but not bound to an action
+  KEY_ESCAPE,   // a bare \e press - nothing followed it
+  KEY_UP,
+  KEY_DOWN,
+  KEY_RIGHT,
+  KEY_LEFT,
+  KEY_HOME,
+  KEY_END,
+  KEY_PAGE_UP,
+  KEY_PAGE_DOWN,
+  KEY_INSERT,
+  KEY_DELETE,
+  KEY_F1, KEY_F2, KEY_F3, KEY_F4, KEY_F5, KEY_F6,
+  KEY_F7, KEY_F8, KEY_F9, KEY_F10, KEY_F11, KEY_F12,
+};
+
+enum EscapeState {
+  ESCAPE_STATE_GROUND,
+  ESCAPE_STATE_ESC,  // seen \e
+  ESCAPE_STATE_CSI,  // seen \e[ - collecting parameters
+  ESCAPE_STATE_SS3,  // seen \eO - the next byte is the final
+  ESCAPE_STATE_COUNT,
+};
+
+enum EscapeClass {
+  ESCAPE_CLASS_ESC,
+  ESCAPE_CLASS_BRACKET,  // '['
+  ESCAPE_CLASS_SS3,      // 'O'
+  ESCAPE_CLASS_DIGIT,
+  ESCAPE_CLASS_SEP,      // ';' - a modifier parameter follows
+  ESCAPE_CLASS_FINAL,    // 0x40..0x7e - ends a CSI sequence
+  ESCAPE_CLASS_OTHER,
+  ESCAPE_CLASS_COUNT,
+};
+
+// High nibble of a transition entry; the low nibble is the next state.
+#define ESCAPE_ACTION_NONE     (0 << 4)
+#define ESCAPE_ACTION_START    (1 << 4)  // \e - reset the parameter
+#define ESCAPE_ACTION_PARAM    (2 << 4)  // accumulate a parameter digit
+#define ESCAPE_ACTION_LOCK     (3 << 4)  // ';' - keep the first parameter
+#define ESCAPE_ACTION_DISPATCH (4 << 4)  // final byte - look up the key
+
+static const u8 escape_transition[ESCAPE_STATE_COUNT][ESCAPE_CLASS_COUNT] = {
+  // ESC                              '['               'O'
+  // digit                            ';'               final    other
+  { // GROUND - plain bytes pass through untouched
+    ESCAPE_STATE_ESC | ESCAPE_ACTION_START, ESCAPE_STATE_GROUND,
+    ESCAPE_STATE_GROUND, ESCAPE_STATE_GROUND, ESCAPE_STATE_GROUND,
+    ESCAPE_STATE_GROUND, ESCAPE_STATE_GROUND,
+  },
+  { // ESC - anything but a known prefix cancels (alt-chords drop)
+    ESCAPE_STATE_ESC | ESCAPE_ACTION_START, ESCAPE_STATE_CSI,
+    ESCAPE_STATE_SS3, ESCAPE_STATE_GROUND, ESCAPE_STATE_GROUND,
+    ESCAPE_STATE_GROUND, ESCAPE_STATE_GROUND,
+  },
+  { // CSI - digits build the parameter until the final byte
+    ESCAPE_STATE_ESC | ESCAPE_ACTION_START, ESCAPE_STATE_GROUND,
+    ESCAPE_STATE_GROUND | ESCAPE_ACTION_DISPATCH,
+    ESCAPE_STATE_CSI | ESCAPE_ACTION_PARAM,
+    ESCAPE_STATE_CSI | ESCAPE_ACTION_LOCK,
+    ESCAPE_STATE_GROUND | ESCAPE_ACTION_DISPATCH, ESCAPE_STATE_GROUND,
+  },
+  { // SS3 - one final byte, whatever it is
+    ESCAPE_STATE_ESC | ESCAPE_ACTION_START,
+    ESCAPE_STATE_GROUND | ESCAPE_ACTION_DISPATCH,
+    ESCAPE_STATE_GROUND | ESCAPE_ACTION_DISPATCH,
+    ESCAPE_STATE_GROUND | ESCAPE_ACTION_DISPATCH,
+    ESCAPE_STATE_GROUND | ESCAPE_ACTION_DISPATCH,
+    ESCAPE_STATE_GROUND | ESCAPE_ACTION_DISPATCH, ESCAPE_STATE_GROUND,
+  },
+};
+
+static u8 escape_class[256];
+
+static void
+escape_class_init (void)
+{
+  if (escape_class['['] == ESCAPE_CLASS_BRACKET) return;  // already built
+
+  for (int c = 0; c < 256; ++c)
+    {
+      escape_class[c] = ESCAPE_CLASS_OTHER;
+      if (c >= 0x40 && c <= 0x7e) escape_class[c] = ESCAPE_CLASS_FINAL;
+    }
+
+  for (int c = '0'; c <= '9'; ++c)
+    {
+      escape_class[c] = ESCAPE_CLASS_DIGIT;
+    }
+
+  escape_class['\e'] = ESCAPE_CLASS_ESC;
+  escape_class['['] = ESCAPE_CLASS_BRACKET;
+  escape_class['O'] = ESCAPE_CLASS_SS3;
+  escape_class[';'] = ESCAPE_CLASS_SEP;
+}
+
+
+/* A binding matches on the state the final byte arrived in, the final
+ * byte itself and - for the \e[N~ family - the first parameter; a
+ * parameter of 0 matches any, which is how \e[1;5H stays Home under a
+ * modifier.
+ */
+struct EscapeBinding {
+  u8 state;
+  u8 final;
+  u16 param;
+  u8 key;
+};
+
+static const EscapeBinding escape_bindings[] = {
+  {ESCAPE_STATE_CSI, 'A',  0, KEY_UP},
+  {ESCAPE_STATE_CSI, 'B',  0, KEY_DOWN},
+  {ESCAPE_STATE_CSI, 'C',  0, KEY_RIGHT},
+  {ESCAPE_STATE_CSI, 'D',  0, KEY_LEFT},
+  {ESCAPE_STATE_CSI, 'H',  0, KEY_HOME},
+  {ESCAPE_STATE_CSI, 'F',  0, KEY_END},
+  {ESCAPE_STATE_CSI, '~',  1, KEY_HOME},
+  {ESCAPE_STATE_CSI, '~',  2, KEY_INSERT},
+  {ESCAPE_STATE_CSI, '~',  3, KEY_DELETE},
+  {ESCAPE_STATE_CSI, '~',  4, KEY_END},
+  {ESCAPE_STATE_CSI, '~',  5, KEY_PAGE_UP},
+  {ESCAPE_STATE_CSI, '~',  6, KEY_PAGE_DOWN},
+  {ESCAPE_STATE_CSI, '~',  7, KEY_HOME},
+  {ESCAPE_STATE_CSI, '~',  8, KEY_END},
+  {ESCAPE_STATE_CSI, '~', 11, KEY_F1},
+  {ESCAPE_STATE_CSI, '~', 12, KEY_F2},
+  {ESCAPE_STATE_CSI, '~', 13, KEY_F3},
+  {ESCAPE_STATE_CSI, '~', 14, KEY_F4},
+  {ESCAPE_STATE_CSI, '~', 15, KEY_F5},
+  {ESCAPE_STATE_CSI, '~', 17, KEY_F6},
+  {ESCAPE_STATE_CSI, '~', 18, KEY_F7},
+  {ESCAPE_STATE_CSI, '~', 19, KEY_F8},
+  {ESCAPE_STATE_CSI, '~', 20, KEY_F9},
+  {ESCAPE_STATE_CSI, '~', 21, KEY_F10},
+  {ESCAPE_STATE_CSI, '~', 23, KEY_F11},
+  {ESCAPE_STATE_CSI, '~', 24, KEY_F12},
+  {ESCAPE_STATE_SS3, 'A',  0, KEY_UP},
+  {ESCAPE_STATE_SS3, 'B',  0, KEY_DOWN},
+  {ESCAPE_STATE_SS3, 'C',  0, KEY_RIGHT},
+  {ESCAPE_STATE_SS3, 'D',  0, KEY_LEFT},
+  {ESCAPE_STATE_SS3, 'H',  0, KEY_HOME},
+  {ESCAPE_STATE_SS3, 'F',  0, KEY_END},
+  {ESCAPE_STATE_SS3, 'P',  0, KEY_F1},
+  {ESCAPE_STATE_SS3, 'Q',  0, KEY_F2},
+  {ESCAPE_STATE_SS3, 'R',  0, KEY_F3},
+  {ESCAPE_STATE_SS3, 'S',  0, KEY_F4},
+};
+
+struct EscapeDecoder {
+  u8 state;
+  u16 param;
+  b8 locked;  // past the first parameter - stop accumulating
+};
+
+/* How long a lone \e at the end of a chunk waits for the rest of a
+ * sequence before it counts as the Escape key.  A terminal writes a
+ * sequence back-to-back, so even over ssh the remainder lands within
+ * a few milliseconds; a human can't type a follow-up byte this fast.
+ */
+#define ESCAPE_LONE_TIMEOUT_MS 25
+
+
+/* Feeds one byte.  Returns KEY_NONE while a sequence is pending and
+ * the decoded key when one completes; a byte arriving in the ground
+ * state also returns KEY_NONE and stays the caller's to handle.
+ */
+static u8
+escape_decode (EscapeDecoder *decoder, char byte)
+{
+  u8 entry = escape_transition[decoder->state][escape_class[(u8) byte]];
+  u8 from = decoder->state;
+  decoder->state = entry & 0x0f;
+
+  switch (entry & 0xf0)
+    {
+    case ESCAPE_ACTION_START:
+      decoder->param = 0;
+      decoder->locked = 0;
+      break;
+
+    case ESCAPE_ACTION_PARAM:
+      if (!decoder->locked)
+        {
+          decoder->param = decoder->param * 10 + (byte - '0');
+        }
+      break;
+
+    case ESCAPE_ACTION_LOCK:
+      decoder->locked = 1;
+      break;
+
+    case ESCAPE_ACTION_DISPATCH:
+      for (size_t i = 0;
+           i < sizeof (escape_bindings) / sizeof (*escape_bindings); ++i)
+        {
+          const EscapeBinding *binding = &escape_bindings[i];
+          if (binding->state == from &&
+              binding->final == (u8) byte &&
+              (binding->param == 0 || binding->param == decoder->param))
+            {
+              return binding->key;
+            }
+        }
+      return KEY_IGNORED;
+    }
+
+  return KEY_NONE;
+}
+
+
+/* Streaming loader.  loader_begin returns as soon as the first chunk
+ * (or the mmap) is in place so the first screenful can be painted
+ * immediately; while active, loader_step appends one chunk at a time,
+ * called from the main loop whenever the user isn't typing.  Chunked
+ * reads also mean st_size is only a capacity hint, so pipes and
+ * virtual files whose size lies load correctly.
+ */
+#define LOADER_CHUNK_SIZE (256u << 10)
+
+struct Loader {
+  int fd;
+  b8 active;
+  char *chunk;
+};
+
+
+// Appends one chunk; returns the bytes appended, 0 when done.
+static size_t
+loader_step (Loader *loader, Buffer *buffer)
+{
+  if (!loader->active) return 0;
+
+  ssize_t bytes_read = read (loader->fd, loader->chunk, LOADER_CHUNK_SIZE);
+  assert (bytes_read != -1);
+
+  if (bytes_read == 0)
+    {
+      close (loader->fd);
+      free (loader->chunk);
+      loader->chunk = 0;
+      loader->active = 0;
+      return 0;
+    }
+
+  // The text keeps its trailing NUL at used - 1; chunks go before it.
+  buffer_insert_at (buffer, buffer->used - 1, loader->chunk, bytes_read);
+  return bytes_read;
+}
+
+
+static void
+loader_begin (const char *filepath, Buffer *buffer, Loader *loader)
+{
+  loader->fd = open (filepath, O_RDONLY);
+  assert (loader->fd != -1);
+  loader->active = 0;
+  loader->chunk = 0;
+
+  struct stat file_stat;
+  int fstat_error = fstat (loader->fd, &file_stat);
+  assert (!fstat_error);
+
+  size_t page_size = sysconf (_SC_PAGESIZE);
+
+  if (S_ISREG (file_stat.st_mode) &&
+      (size_t) file_stat.st_size >= MMAP_LOAD_THRESHOLD &&
+      file_stat.st_size % page_size != 0)
+    {
+      // MAP_PRIVATE pages are copy-on-write, so the NUL terminator can
+      // be written into the slack of the last page.  A file ending
+      // exactly on a page boundary has no slack and takes the chunked
+      // path below instead.
+      buffer->data = (char *) mmap (0, file_stat.st_size + 1,
+                                    PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                                    loader->fd, 0);
+      assert (buffer->data != MAP_FAILED);
+      buffer->data[file_stat.st_size] = 0;
+      buffer->used = file_stat.st_size + 1;
+      buffer->size = buffer->used;
+      buffer->gap_start = buffer->used;
+      buffer->generation = 0;
+      buffer->mapped = 1;
+
+      madvise (buffer->data, buffer->size, MADV_SEQUENTIAL);
+
+      close (loader->fd);
+      loader->fd = -1;
+      return;
+    }
+
+  *buffer = new_buffer (file_stat.st_size + 1);
+  buffer->data[0] = 0;
+  buffer->used = 1;
+  buffer->gap_start = 1;
+
+  loader->chunk = (char *) malloc (LOADER_CHUNK_SIZE);
+  assert (loader->chunk);
+  loader->active = 1;
+
+  loader_step (loader, buffer);  // enough for the first screenful
+}
+
+
+static Buffer
+load_file (const char *filepath)
+{
+  Buffer buffer;
+  Loader loader;
+  loader_begin (filepath, &buffer, &loader);
+
+  while (loader.active)
+    {
+      loader_step (&loader, &buffer);
+    }
+
+  return buffer;
+}
+
+
+
+/* Crash-safe autosave.  Every user edit appends a compact delta record
+ * - kind, offset, length, insert payload - to <path>.ttej through a
+ * buffered journal that is flushed and fsync'd from the idle part of
+ * the event loop, so typing never waits on the disk and a crash loses
+ * at most the edits of the last idle gap.  A surviving journal is
+ * replayed over the file content on the next open.
+ *
+ * The journal also tracks the lowest edited offset: everything before
+ * it is byte-identical to the on-disk file, so an explicit save skips
+ * the clean prefix and writes only from there to the end plus a
+ * truncate.  A localized change near the end of a gigabyte file costs
+ * kilobytes of I/O, not a full rewrite.
+ */
+#define AUTOSAVE_RECORD_INSERT 1
+#define AUTOSAVE_RECORD_DELETE 2
+
+struct Autosave {
+  OutputBuffer journal;
+  const char *journal_path;
+  size_t dirty_begin;  // First byte that may differ from the file
+  b8 dirty;
+  b8 synced;           // No journal bytes pending flush + fsync
+  b8 active;           // Journaling enabled - documents with a path
+};
+
+
+static void
+autosave_record (Autosave *autosave, u8 kind, size_t offset,
+                 const char *text, size_t length)
+{
+  if (!autosave->active) return;
+
+  if (!autosave->dirty || offset < autosave->dirty_begin)
+    {
+      autosave->dirty_begin = offset;
+    }
+  autosave->dirty = 1;
+
+  u64 header[2] = {offset, length};
+  out_append_char (&autosave->journal, kind);
+  out_append (&autosave->journal, (const char *) header, sizeof header);
+
+  if (kind == AUTOSAVE_RECORD_INSERT)
+    {
+      out_append (&autosave->journal, text, length);
+    }
+
+  autosave->synced = 0;
+}
+
+
+static void
+autosave_sync (Autosave *autosave)
+{
+  if (!autosave->active || autosave->synced) return;
+
+  out_flush (&autosave->journal);
+  fsync (autosave->journal.fd);
+  autosave->synced = 1;
+}
+
+
+static void
+autosave_begin (Autosave *autosave, const char *path, Buffer *buffer,
+                Loader *loader, Arena *arena)
+{
+  autosave->journal_path = 0;
+  autosave->dirty_begin = 0;
+  autosave->dirty = 0;
+  autosave->synced = 1;
+  autosave->active = 0;
+
+  if (!path) return;
+
+  size_t path_length = strlen (path);
+  char *journal_path = (char *) arena_alloc (arena, path_length + 6);
+  memcpy (journal_path, path, path_length);
+  memcpy (journal_path + path_length, ".ttej", 6);
+  autosave->journal_path = journal_path;
+
+  /* Crash recovery: a non-empty journal means the last session died
+   * with unsaved edits - replay them over the file content before any
+   * derived data is built.  Needs the whole file, so a streaming load
+   * is drained first.
+   */
+  struct stat journal_stat;
+  if (!stat (journal_path, &journal_stat) && journal_stat.st_size > 0)
+    {
+      while (loader->active)
+        {
+          loader_step (loader, buffer);
+        }
+
+      char *records = (char *) malloc (journal_stat.st_size);
+      assert (records);
+
+      int fd = open (journal_path, O_RDONLY);
+      assert (fd != -1);
+      ssize_t bytes_read = read (fd, records, journal_stat.st_size);
+      assert (bytes_read == journal_stat.st_size);
+      close (fd);
+
+      char *p = records;
+      char *end = records + bytes_read;
+
+      while (p + 1 + sizeof (u64[2]) <= end)
+        {
+          u8 kind = *p++;
+          u64 header[2];
+          memcpy (header, p, sizeof header);
+          p += sizeof header;
+
+          if (kind == AUTOSAVE_RECORD_INSERT)
+            {
+              if (p + header[1] > end) break;  // truncated tail record
+              buffer_insert_at (buffer, header[0], p, header[1]);
+              p += header[1];
+            }
+          else
+            {
+              buffer_delete_range (buffer, header[0], header[1]);
+            }
+
+          if (!autosave->dirty || header[0] < autosave->dirty_begin)
+            {
+              autosave->dirty_begin = header[0];
+            }
+          autosave->dirty = 1;
+        }
+
+      free (records);
+    }
+
+  int fd = open (journal_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  assert (fd != -1);
+  autosave->journal = new_output_buffer (fd, 16 * 1024);
+  autosave->active = 1;
+}
+
+
+// Flushes what is pending, drops a journal with nothing to recover
+// and closes the fd.  A non-empty journal survives for the next open.
+static void
+autosave_end (Autosave *autosave)
+{
+  if (!autosave->active) return;
+
+  out_flush (&autosave->journal);
+  fsync (autosave->journal.fd);
+
+  struct stat journal_stat;
+  if (!fstat (autosave->journal.fd, &journal_stat) &&
+      journal_stat.st_size == 0)
+    {
+      unlink (autosave->journal_path);
+    }
+
+  close (autosave->journal.fd);
+  free (autosave->journal.buffer.data);
+  autosave->active = 0;
+}
+
+
+/* In-place save.  The clean prefix before dirty_begin is already on
+ * disk; only the rest is written, followed by a truncate and fsync.
+ * The superseded journal is emptied.  Refuses while a load is still
+ * streaming - the file would be truncated to partial content.
+ */
+static void
+document_save (const char *path, Buffer *buffer, Loader *loader,
+               Autosave *autosave)
+{
+  if (!autosave->active || !autosave->dirty || loader->active) return;
+
+  /* Delete-only edits never trigger the copy-out in buffer_reserve,
+   * so the buffer can still be a MAP_PRIVATE view of the very file
+   * about to be rewritten.  Writing through that is a trap: pages not
+   * yet faulted are still backed by the file, so whether they show
+   * the old or the freshly written bytes is unspecified - and the
+   * mapping would be stale after the truncate anyway.  Own the
+   * memory first.
+   */
+  buffer_own (buffer);
+
+  int fd = open (path, O_WRONLY);
+  assert (fd != -1);
+
+  size_t text_length = buffer->used ? buffer->used - 1 : 0;
+  size_t offset = autosave->dirty_begin;
+  if (offset > text_length) offset = text_length;
+
+  off_t seek_offset = lseek (fd, offset, SEEK_SET);
+  assert (seek_offset == (off_t) offset);
+
+  while (offset < text_length)
+    {
+      size_t span_length;
+      char *span = buffer_span (buffer, offset, &span_length);
+      if (offset + span_length > text_length)
+        {
+          span_length = text_length - offset;
+        }
+
+      ssize_t written = write (fd, span, span_length);
+      assert (written == (ssize_t) span_length);
+      offset += span_length;
+    }
+
+  int truncate_error = ftruncate (fd, text_length);
+  assert (!truncate_error);
+  fsync (fd);
+  close (fd);
+
+  autosave->journal.buffer.used = 0;  // pending records are superseded
+  int journal_truncate_error = ftruncate (autosave->journal.fd, 0);
+  assert (!journal_truncate_error);
+  autosave->dirty = 0;
+  autosave->synced = 1;
+}
+
+
+/* File watcher.  A document holding a growing file - a build log
+ * being appended to - follows the file without a reload: inotify
+ * events are drained from idle event-loop iterations (and wake the
+ * blocking input wait), a grown file whose old tail still matches
+ * streams only the new suffix through the append path, and an
+ * in-place rewrite splices just the span between the first and last
+ * differing byte.  Tail-following a multi-gigabyte log costs I/O
+ * proportional to the appended bytes.  Local edits always win: a
+ * modified document parks its events and ignores the disk.
+ */
+
+struct Watcher {
+  int fd;
+  b8 active;
+};
+
+
+static Watcher
+watcher_begin (const char *path)
+{
+  Watcher watcher;
+  watcher.fd = -1;
+  watcher.active = 0;
+
+  if (!path) return watcher;
+
+  watcher.fd = inotify_init1 (IN_NONBLOCK);
+  if (watcher.fd == -1) return watcher;
+
+  if (inotify_add_watch (watcher.fd, path,
+                         IN_MODIFY | IN_CLOSE_WRITE) == -1)
+    {
+      close (watcher.fd);
+      watcher.fd = -1;
+      return watcher;
+    }
+
+  watcher.active = 1;
+  return watcher;
+}
+
+
+static void
+watcher_end (Watcher *watcher)
+{
+  if (!watcher->active) return;
+  close (watcher->fd);
+  watcher->fd = -1;
+  watcher->active = 0;
+}
+
+
+// Drains queued events; returns whether the file changed on disk.
+static b8
+watcher_poll (Watcher *watcher)
+{
+  if (!watcher->active) return 0;
+
+  char events[4096];
+  b8 changed = 0;
+
+  for (;;)
+    {
+      ssize_t length = read (watcher->fd, events, sizeof (events));
+      if (length <= 0) break;
+
+      ssize_t at = 0;
+      while (at < length)
+        {
+          struct inotify_event *event =
+            (struct inotify_event *) (events + at);
+          if (event->mask & (IN_MODIFY | IN_CLOSE_WRITE)) changed = 1;
+          at += sizeof (struct inotify_event) + event->len;
+        }
+    }
+
+  return changed;
+}
+
+
+/* Mirrors an on-disk change into the buffer through the edit
+ * chokepoints, so the line index and highlight contexts update for
+ * the changed lines only.  A grown file is verified against a small
+ * window of the old tail before the suffix streams in; when the tail
+ * moved - an in-place rewrite - the whole file is re-read once and
+ * only the differing span is spliced.  Returns whether anything
+ * changed.
+ */
+static b8
+watcher_reload (const char *path, Buffer *buffer, LineIndex *index,
+                HighlightState *highlight)
+{
+  int fd = open (path, O_RDONLY);
+  if (fd == -1) return 0;
+
+  struct stat file_stat;
+  if (fstat (fd, &file_stat))
+    {
+      close (fd);
+      return 0;
+    }
+
+  size_t disk_size = file_stat.st_size;
+  size_t text_size = buffer->used - 1;
+  b8 changed = 0;
+
+  if (disk_size > text_size)
+    {
+      char window[4096];
+      size_t window_size = text_size < sizeof (window)
+                         ? text_size : sizeof (window);
+      b8 append = pread (fd, window, window_size,
+                         text_size - window_size) == (ssize_t) window_size;
+
+      for (size_t i = 0; append && i < window_size; ++i)
+        {
+          if (window[i] !=
+              buffer_char_at (buffer, text_size - window_size + i))
+            {
+              append = 0;
+            }
+        }
+
+      if (append)
+        {
+          char *chunk = (char *) malloc (LOADER_CHUNK_SIZE);
+          assert (chunk);
+
+          size_t at = text_size;
+          while (at < disk_size)
+            {
+              size_t want = disk_size - at;
+              if (want > LOADER_CHUNK_SIZE) want = LOADER_CHUNK_SIZE;
+
+              ssize_t got = pread (fd, chunk, want, at);
+              if (got <= 0) break;
+
+              edit_insert (buffer, index, highlight, at, chunk, got);
+              at += got;
+              changed = 1;
+            }
+
+          free (chunk);
+          close (fd);
+          return changed;
+        }
+    }
+
+  // In-place rewrite: one full read, then splice the differing span.
+  // The ends are matched up first so a one-line change in the middle
+  // re-highlights one line, not the rest of the file.
+  char *data = (char *) malloc (disk_size ? disk_size : 1);
+  assert (data);
+
+  size_t have = 0;
+  while (have < disk_size)
+    {
+      ssize_t got = pread (fd, data + have, disk_size - have, have);
+      if (got <= 0) break;
+      have += got;
+    }
+  close (fd);
+
+  if (have != disk_size)
+    {
+      free (data);
+      return 0;
+    }
+
+  size_t common = text_size < disk_size ? text_size : disk_size;
+  size_t first = 0;
+  while (first < common && data[first] == buffer_char_at (buffer, first))
+    {
+      ++first;
+    }
+
+  size_t old_end = text_size;
+  size_t new_end = disk_size;
+  while (old_end > first && new_end > first &&
+         buffer_char_at (buffer, old_end - 1) == data[new_end - 1])
+    {
+      --old_end;
+      --new_end;
+    }
+
+  if (old_end > first)
+    {
+      edit_delete (buffer, index, highlight, first, old_end - first);
+      changed = 1;
+    }
+
+  if (new_end > first)
+    {
+      edit_insert (buffer, index, highlight, first,
+                   data + first, new_end - first);
+      changed = 1;
+    }
+
+  free (data);
+  return changed;
+}
+
+
+
+/* One open file.  A session holds many documents, but they are opened
+ * lazily: until first viewed a document is only its path and a stat'd
+ * size.  On first view document_realize loads the buffer - mmap'd
+ * read-only pages stay shared with the page cache until the first edit
+ * copies them, see buffer_reserve - and builds the derived data, all
+ * bumped out of the document's own arena.  DOCUMENT_RESIDENT_MAX caps
+ * how many realized documents are kept; past it the least recently
+ * viewed clean document is dropped back to its path, so a session with
+ * 200 files costs little more than the few actually being edited.
+ */
+#define DOCUMENT_RESIDENT_MAX 8
+
+struct Document {
+  const char *path;     // 0 for the unnamed scratch document
+  size_t file_size;     // From stat at session start
+  Buffer buffer;
+  Loader loader;
+  LineIndex line_index;
+  HighlightState highlight;
+  UndoJournal undo;
+  Autosave autosave;
+  Watcher watch;
+  Arena arena;
+  size_t x;
+  size_t y;
+  size_t top_line;
+  size_t left_col;
+  u64 last_viewed;
+  b8 loaded;
+  b8 modified;          // Has edits - never dropped
+};
+
+
+static Document
+new_document (const char *path)
+{
+  Document document;
+  document.path = path;
+  document.file_size = 0;
+  document.loader.active = 0;
+  document.autosave.active = 0;
+  document.watch.fd = -1;
+  document.watch.active = 0;
+  document.arena = new_arena (1u << 16);
+  document.x = 0;
+  document.y = 0;
+  document.top_line = 0;
+  document.left_col = 0;
+  document.last_viewed = 0;
+  document.loaded = 0;
+  document.modified = 0;
+
+  if (path)
+    {
+      struct stat file_stat;
+      int stat_error = stat (path, &file_stat);
+      assert (!stat_error);
+      document.file_size = file_stat.st_size;
+    }
+
+  return document;
+}
+
+
+// Drops the least recently viewed clean document once the resident
+// count hits the cap; edited or still-loading documents are kept.
+static void
+documents_evict (Document *documents, size_t count, size_t keep)
+{
+  size_t resident = 0;
+  size_t victim = (size_t) -1;
+
+  for (size_t i = 0; i < count; ++i)
+    {
+      Document *document = &documents[i];
+
+      if (!document->loaded) continue;
+      ++resident;
+
+      if (i == keep || document->modified || document->loader.active)
+        {
+          continue;
+        }
+
+      if (victim == (size_t) -1 ||
+          document->last_viewed < documents[victim].last_viewed)
+        {
+          victim = i;
+        }
+    }
+
+  if (resident < DOCUMENT_RESIDENT_MAX || victim == (size_t) -1) return;
+
+  Document *dropped = &documents[victim];
+  autosave_end (&dropped->autosave);
+  watcher_end (&dropped->watch);
+  buffer_free (&dropped->buffer);
+  arena_free (&dropped->arena);
+  dropped->loaded = 0;
+}
+
+
+static void
+document_realize (Document *document)
+{
+  if (document->loaded) return;
+
+  document->loader.active = 0;
+
+  if (document->path)
+    {
+      loader_begin (document->path, &document->buffer, &document->loader);
+    }
+  else
+    {
+      document->buffer = new_buffer (4096);
+      char terminator = 0;
+      buffer_insert_at (&document->buffer, 0, &terminator, 1);
+    }
+
+  autosave_begin (&document->autosave, document->path, &document->buffer,
+                  &document->loader, &document->arena);
+  document->watch = watcher_begin (document->path);
+
+  // Replayed recovery edits count as modifications.
+  if (document->autosave.dirty) document->modified = 1;
+
+  document->line_index = new_line_index (&document->arena);
+  line_index_rebuild (&document->line_index, &document->buffer);
+  document->highlight = new_highlight_state (&document->arena);
+  highlight_rebuild (&document->highlight, &document->buffer,
+                     &document->line_index);
+  document->undo = new_undo_journal (&document->arena);
+  document->loaded = 1;
+
+  // The cursor survives a drop and reload, but the file may differ.
+  if (document->y + document->x >= document->buffer.used)
+    {
+      document->x = 0;
+      document->y = 0;
+      document->top_line = 0;
+      document->left_col = 0;
+    }
+}
+
+
+/* Read-only pager.  `tte -R file' views a file without the editable
+ * machinery: the file is mmap'd no matter its size, the line index is
+ * a fixed table of checkpoints taken every stride lines and
+ * interpolated by scanning, and highlighting is recomputed for the
+ * visible screen each frame through the same parse_* functions the
+ * editor uses.  The heap holds the checkpoint table, the screen grids
+ * and the output buffer regardless of the file, so a multi-gigabyte
+ * log pages inside a 32 MB cgroup where load_file's malloc of the
+ * whole file cannot.
+ *
+ * Lines are discovered incrementally: the newline scan advances only
+ * as far as the view has ever needed, the way less counts lines.  The
+ * parse context at the screen top is threaded from the nearest
+ * checkpoint entered as global code, so a comment or string spanning
+ * more than a stride of lines can render wrong past it - the price of
+ * keeping no per-line state.
+ */
+#define PAGER_CHECKPOINT_MAX (1u << 16)
+#define PAGER_STRIDE_MIN 64
+
+struct PagerCheckpoint {
+  size_t line;
+  size_t offset;
+};
+
+struct Pager {
+  Buffer buffer;             // mmap'd view, never edited
+  PagerCheckpoint *checkpoints;
+  size_t checkpoint_count;
+  size_t stride;             // lines between checkpoints
+  size_t frontier_offset;    // first byte not yet scanned for newlines
+  size_t frontier_line;      // line frontier_offset sits in
+  size_t line_count;         // valid once complete
+  b8 complete;
+};
+
+
+static Pager
+pager_open (const char *path)
+{
+  Pager pager;
+
+  // Normally new_highlight_state builds these; the pager parses
+  // without one.
+  char_class_init ();
+  keyword_table_init ();
+
+  int fd = open (path, O_RDONLY);
+  assert (fd != -1);
+
+  struct stat file_stat;
+  int fstat_error = fstat (fd, &file_stat);
+  assert (!fstat_error);
+  assert (S_ISREG (file_stat.st_mode));
+
+  /* Map st_size + 1 and write the terminating NUL into the slack of
+   * the last page, as load_file's mmap path does.  A file ending
+   * exactly on a page boundary has no slack and the extra page would
+   * fault, so the NUL is skipped there - safe because the read-only
+   * paths below never touch the byte at used - 1, only the editable
+   * paths need the terminator in place.
+   */
+  size_t page_size = sysconf (_SC_PAGESIZE);
+  pager.buffer.data = (char *) mmap (0, file_stat.st_size + 1,
+                                     PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                                     fd, 0);
+  assert (pager.buffer.data != MAP_FAILED);
+  if (file_stat.st_size % page_size != 0)
+    {
+      pager.buffer.data[file_stat.st_size] = 0;
+    }
+  pager.buffer.used = file_stat.st_size + 1;
+  pager.buffer.size = pager.buffer.used;
+  pager.buffer.gap_start = pager.buffer.used;
+  pager.buffer.generation = 0;
+  pager.buffer.mapped = 1;
+
+  close (fd);
+
+  pager.checkpoints = (PagerCheckpoint *)
+    malloc (PAGER_CHECKPOINT_MAX * sizeof (PagerCheckpoint));
+  assert (pager.checkpoints);
+  pager.checkpoints[0].line = 0;
+  pager.checkpoints[0].offset = 0;
+  pager.checkpoint_count = 1;
+  pager.stride = PAGER_STRIDE_MIN;
+  pager.frontier_offset = 0;
+  pager.frontier_line = 0;
+  pager.line_count = 0;
+  pager.complete = 0;
+  return pager;
+}
+
+
+/* Advances the newline scan until the frontier passes target_line or
+ * the end of the text, dropping a checkpoint every stride lines.
+ * When the table fills, every other checkpoint is discarded and the
+ * stride doubles, so the fixed budget holds for any file.
+ */
+static void
+pager_scan_to (Pager *pager, size_t target_line)
+{
+  if (pager->complete) return;
+
+  size_t text_length = pager->buffer.used - 1;
+  char *data = pager->buffer.data;  // the mapping never gains a gap
+
+  while (pager->frontier_line <= target_line)
+    {
+      char *newline = (char *) memchr (data + pager->frontier_offset, '\n',
+                                       text_length - pager->frontier_offset);
+      if (!newline)
+        {
+          pager->line_count = pager->frontier_line + 1;
+          pager->complete = 1;
+          return;
+        }
+
+      pager->frontier_offset = newline - data + 1;
+      ++pager->frontier_line;
+
+      if (pager->frontier_line % pager->stride == 0)
+        {
+          if (pager->checkpoint_count == PAGER_CHECKPOINT_MAX)
+            {
+              for (size_t i = 1; 2 * i < PAGER_CHECKPOINT_MAX; ++i)
+                {
+                  pager->checkpoints[i] = pager->checkpoints[2 * i];
+                }
+              pager->checkpoint_count = PAGER_CHECKPOINT_MAX / 2;
+              pager->stride *= 2;
+            }
+
+          if (pager->frontier_line % pager->stride == 0)
+            {
+              PagerCheckpoint *checkpoint =
+                &pager->checkpoints[pager->checkpoint_count++];
+              checkpoint->line = pager->frontier_line;
+              checkpoint->offset = pager->frontier_offset;
+            }
+        }
+    }
+}
+
+
+// Largest top_line that still shows content; unbounded until the line
+// count is known.
+static size_t
+pager_last_top (Pager *pager, u16 rows)
+{
+  if (!pager->complete) return (size_t) -1;
+  if (pager->line_count > rows) return pager->line_count - rows;
+  return 0;
+}
+
+
+/* Paints one frame.  The walk starts at the nearest checkpoint at or
+ * before top_line, threads the parse context through the off-screen
+ * lines with highlight_line in context-only mode, then paints the
+ * visible rows - at most a stride plus a screenful of lines per
+ * frame.  Each line is presented to highlight_line through a
+ * two-entry window index carrying its real buffer offsets, so the
+ * editor's parser runs unchanged with no per-line state ever stored.
+ */
+static void
+pager_render (Pager *pager, size_t top_line, size_t left_col,
+              Screen *screen, u16 rows)
+{
+  size_t text_length = pager->buffer.used - 1;
+  char *data = pager->buffer.data;
+
+  // Nearest checkpoint at or before the screen top.
+  size_t lo = 0;
+  size_t hi = pager->checkpoint_count;
+  while (hi - lo > 1)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (pager->checkpoints[mid].line <= top_line) lo = mid;
+      else                                          hi = mid;
+    }
+
+  size_t line = pager->checkpoints[lo].line;
+  size_t offset = pager->checkpoints[lo].offset;
+
+  // Fault the walk's region in ahead of the line-by-line scan.
+  buffer_readahead (&pager->buffer, offset, 1u << 20);
+
+  TextContext context;
+  context.type = TEXT_CONTEXT_GLOBAL;
+  context.length = 0;
+
+  b8 lines_left = 1;
+
+  while (lines_left && line < top_line + rows)
+    {
+      char *newline = (char *) memchr (data + offset, '\n',
+                                       text_length - offset);
+
+      size_t window_offsets[2];
+      window_offsets[0] = offset;
+      window_offsets[1] = newline ? (size_t) (newline - data) + 1 : 0;
+
+      LineIndex window;
+      window.offsets = window_offsets;
+      window.count = newline ? 2 : 1;
+      window.size = 2;
+      window.arena = 0;
+
+      RowWriter row;
+      RowWriter *visible = 0;
+
+      if (line >= top_line)
+        {
+          row.cells = screen->back + (size_t) (line - top_line) * screen->cols;
+          row.pos = 0;
+          row.left = left_col;
+          row.cols = screen->cols;
+          row.col = 0;
+          row.attr = CELL_ATTR_PLAIN;
+          visible = &row;
+        }
+
+      context = highlight_line (&pager->buffer, &window, 0, context, visible);
+
+      if (visible)
+        {
+          while (row.col < row.cols)
+            {
+              row.cells[row.col].cp = ' ';
+              row.cells[row.col].attr = CELL_ATTR_PLAIN;
+              ++row.col;
+            }
+        }
+
+      if (newline) offset = window_offsets[1];
+      else         lines_left = 0;
+      ++line;
+    }
+
+  // Rows past the end of the file stay blank.
+  for (size_t r = line > top_line ? line - top_line : 0; r < rows; ++r)
+    {
+      Cell *cells = screen->back + r * screen->cols;
+      for (u16 c = 0; c < screen->cols; ++c)
+        {
+          cells[c].cp = ' ';
+          cells[c].attr = CELL_ATTR_PLAIN;
+        }
+    }
+}
+
+
+static void
+pager_status (Pager *pager, const char *path, size_t top_line,
+              size_t bottom_line, Screen *screen, u16 rows)
+{
+  char text[600];
+
+  if (pager->complete)
+    {
+      size_t percent = 100 * (bottom_line + 1) / pager->line_count;
+      sprintf (text, "[%.256s] L%lu-%lu/%lu (%lu%%) read-only; ",
+               path, top_line + 1, bottom_line + 1,
+               pager->line_count, percent);
+    }
+  else
+    {
+      // The scan hasn't reached the end - the total is still unknown.
+      sprintf (text, "[%.256s] L%lu-%lu/? read-only; ",
+               path, top_line + 1, bottom_line + 1);
+    }
+
+  RowWriter row;
+  row.cells = screen->back + (size_t) rows * screen->cols;
+  row.pos = 0;
+  row.left = 0;
+  row.cols = screen->cols;
+  row.col = 0;
+  row.attr = CELL_ATTR_STATUS;
+  row_put (&row, text, strlen (text));
+
+  while (row.col < row.cols)
+    {
+      row_put_char (&row, '-');
+    }
+}
+
+
+/* The pager's event loop - a stripped-down main: no edits, no loader,
+ * no idle work, so a frame is scan, render, flush, block on stdin.
+ * Arrows move a line or half a screen sideways, space/f and b page,
+ * g/Home and G/End jump - End drains the scan to learn the line count
+ * - and q, ESC or ^Q leave.
+ */
+static int
+pager_run (const char *path, const TerminalProfile *terminal)
+{
+  Pager pager = pager_open (path);
+
+  OutputBuffer out = new_output_buffer (1, 64 * 1024);
+  Screen screen = new_screen ();
+
+  termios original_terminal_attributes = init_screen (terminal);
+
+  size_t top_line = 0;
+  size_t left_col = 0;
+  int keep_running = 1;
+
+  while (keep_running)
+    {
+      struct winsize window_size;
+      ioctl (STDOUT_FILENO, TIOCGWINSZ, &window_size);
+      if (window_size.ws_row == 0) window_size.ws_row = 24;
+      if (window_size.ws_col == 0) window_size.ws_col = 80;
+
+      u16 rows = window_size.ws_row - 1;  // status line takes the last row
+      screen_resize (&screen, window_size.ws_row, window_size.ws_col);
+
+      pager_scan_to (&pager, top_line + rows);
+      size_t last_top = pager_last_top (&pager, rows);
+      if (top_line > last_top) top_line = last_top;
+
+      pager_render (&pager, top_line, left_col, &screen, rows);
+
+      size_t bottom_line = top_line + rows - 1;
+      if (pager.complete && bottom_line >= pager.line_count)
+        {
+          bottom_line = pager.line_count - 1;
+        }
+      pager_status (&pager, path, top_line, bottom_line, &screen, rows);
+
+      screen_flush (&screen, &out);
+      out_append (&out, STR ("\e[0m"));
+      screen_emit_address (&screen, &out, rows, 0);
+      out_flush (&out);
+
+      char input[64];
+      ssize_t bytes_read = read (0, input, 64);
+      assert (bytes_read != -1);
+      if (bytes_read == 0) break;  // end of input - nothing will ever arrive
+
+      /* A paste into a read-only view is swallowed whole so its bytes
+       * aren't interpreted as key presses; anything trailing the
+       * terminator in the same chunk is dropped with it.
+       */
+      if (bytes_read >= 6 && !memcmp (input, "\e[200~", 6))
+        {
+          char window[70];
+          size_t window_used = bytes_read - 6;
+          memcpy (window, input + 6, window_used);
+
+          while (!memmem (window, window_used, "\e[201~", 6))
+            {
+              // The terminator can straddle a read boundary, so the
+              // last five bytes carry over.
+              size_t keep = window_used > 5 ? 5 : window_used;
+              memmove (window, window + window_used - keep, keep);
+
+              ssize_t more = read (0, window + keep, 64);
+              assert (more != -1);
+              if (more == 0)
+                {
+                  keep_running = 0;
+                  break;
+                }
+              window_used = keep + more;
+            }
+
+          continue;
+        }
+
+      size_t page = rows;
+      size_t half = window_size.ws_col / 2;
+
+      if (bytes_read == 1)
+        {
+          switch (input[0])
+            {
+            case 'q':
+            case '\e':
+            case 'Q' - '@': keep_running = 0; break;
+            case ' ':
+            case 'f': top_line += page; break;
+            case 'b': top_line = top_line > page ? top_line - page : 0; break;
+            case 'g': top_line = 0; left_col = 0; break;
+            case 'G':
+              {
+                pager_scan_to (&pager, (size_t) -1);
+                top_line = pager_last_top (&pager, rows);
+              } break;
             }
-          else
+        }
+      else if (bytes_read == 3 &&
+               input[0] == '\e' &&
+               input[1] == '[')
+        {
+          switch (input[2])
+            {
+            case 'A': if (top_line) --top_line; break;  // UP
+            case 'B': ++top_line; break;                // DOWN
+            case 'C': left_col += half; break;          // RIGHT
+            case 'D': left_col = left_col > half ? left_col - half : 0; break;
+            case 'H': top_line = 0; left_col = 0; break;  // HOME
+            case 'F':                                     // END
+              {
+                pager_scan_to (&pager, (size_t) -1);
+                top_line = pager_last_top (&pager, rows);
+              } break;
+            default: break;  // a pager ignores what it doesn't bind
+            }
+        }
+      else if (bytes_read == 4 &&
+               input[0] == '\e' &&
+               input[1] == '[' &&
+               input[3] == '~')
+        {
+          if (input[2] == '5')       // PAGE UP
+            {
+              top_line = top_line > page ? top_line - page : 0;
+            }
+          else if (input[2] == '6')  // PAGE DOWN
             {
-              sprintf (numstr, "\\x%x", input[i]);
+              top_line += page;
             }
-          strcat (line_buffer, numstr);
         }
-      strcat  (line_buffer, "\"");
+    }
 
-      if (bytes_read == 1)
+  out_flush (&out);
+  destroy_screen (original_terminal_attributes, terminal);
+
+  free (pager.checkpoints);
+  buffer_free (&pager.buffer);
+  free (screen.front);
+  free (screen.back);
+  free (screen.addresses);
+  free (screen.address_lengths);
+  free (out.buffer.data);
+  return 0;
+}
+
+
+#ifndef TTE_BENCH
+
+int
+main (int argc, char **argv)
+{
+  const TerminalProfile *terminal = init (argv[0]);
+  if (!terminal) return 1;
+
+  theme_color_depth = terminal->color_depth;
+  const char *term_name = getenv ("TERM");
+  if (term_name && strstr (term_name, "256color"))
+    {
+      theme_color_depth = 256;
+    }
+  const char *colorterm = getenv ("COLORTERM");
+  if (colorterm && strstr (colorterm, "truecolor"))
+    {
+      theme_color_depth = 1u << 24;
+    }
+
+  // `tte -R file' pages the file read-only with a fixed memory
+  // footprint - see the Pager section.
+  if (argc > 2 && !strcmp (argv[1], "-R"))
+    {
+      return pager_run (argv[2], terminal);
+    }
+
+  OutputBuffer out = new_output_buffer (1, 64 * 1024);
+
+  /* session_arena holds state outliving any one document (search
+   * matches); each document's derived data bumps out of its own arena
+   * so dropping the document is one arena_free.  frame_arena is
+   * scratch recycled at the top of every main loop iteration.
+   */
+  Arena session_arena = new_arena (1u << 16);
+  Arena frame_arena = new_arena (4096);
+
+  /* Every file named on the command line becomes a document; only the
+   * current one is realized here, the rest stay a path and a size
+   * until first viewed.
+   */
+  size_t document_count = argc > 1 ? (size_t) (argc - 1) : 1;
+  Document *documents =
+    (Document *) malloc (document_count * sizeof (Document));
+  assert (documents);
+
+  for (size_t i = 0; i < document_count; ++i)
+    {
+      documents[i] = new_document (argc > 1 ? argv[i + 1] : 0);
+    }
+
+  size_t current_document = 0;
+  u64 view_tick = 0;
+
+  document_realize (&documents[0]);
+  documents[0].last_viewed = ++view_tick;
+
+  /* The loop works on by-value copies of the current document's state;
+   * switching documents writes them back.  The arena pointers inside
+   * keep pointing at the Document's own arena, which stays in place.
+   */
+  Buffer buffer = documents[0].buffer;
+  Loader loader = documents[0].loader;
+  LineIndex line_index = documents[0].line_index;
+  HighlightState highlight = documents[0].highlight;
+  UndoJournal undo = documents[0].undo;
+  Autosave autosave = documents[0].autosave;
+  Watcher watcher = documents[0].watch;
+
+  Search search = new_search (&session_arena);
+
+  termios original_terminal_attributes = init_screen (terminal);
+
+  size_t x = 0;
+  size_t y = 0;
+  int keep_running = 1;
+
+  Viewport viewport;
+  viewport.top_line = 0;
+  viewport.left_col = 0;
+  b8 content_dirty = 1;
+
+  ColumnCache column_cache;
+  column_cache.generation = 0;
+  column_cache.line = (size_t) -1;
+  column_cache.offset = 0;
+  column_cache.column = 0;
+
+  FrameStats frame_stats;
+  memset (&frame_stats, 0, sizeof frame_stats);
+  b8 hud_enabled = 0;
+  int trace_fd = trace_begin ();
+
+  Screen screen = new_screen ();
+
+  StatusLine status = new_status_line ();
+
+  // Goto-line entry, driven like the search prompt.
+  b8 goto_entering = 0;
+  char goto_text[24];
+  size_t goto_length = 0;
+
+  // Escape input decoder; its state survives a read() boundary.
+  escape_class_init ();
+  EscapeDecoder escape;
+  escape.state = ESCAPE_STATE_GROUND;
+  escape.param = 0;
+  escape.locked = 0;
+
+  // Viewport origin as of the last flush - what the terminal shows.
+  size_t flushed_top_line = viewport.top_line;
+  size_t flushed_left_col = viewport.left_col;
+
+  while (keep_running)
+    {
+      arena_reset (&frame_arena);
+
+      r64 phase_start = now_seconds ();
+      u64 frame_bytes_base = out_total_bytes;
+      u64 frame_writes_base = out_total_writes;
+
+      struct winsize window_size;
+      ioctl (STDOUT_FILENO, TIOCGWINSZ, &window_size);
+      if (window_size.ws_row == 0) window_size.ws_row = 24;
+      if (window_size.ws_col == 0) window_size.ws_col = 80;
+
+      if (viewport.rows != window_size.ws_row - 1 ||
+          viewport.cols != window_size.ws_col)
+        {
+          content_dirty = 1;
+        }
+      viewport.rows = window_size.ws_row - 1;  // status line takes the last row
+      viewport.cols = window_size.ws_col;
+      screen_resize (&screen, window_size.ws_row, window_size.ws_col);
+
+      // Scroll so the cursor stays visible, sideways included.
+      size_t cursor_line = line_index_find (&line_index, y);
+      if (cursor_line < viewport.top_line)
+        {
+          viewport.top_line = cursor_line;
+          content_dirty = 1;
+        }
+      else if (cursor_line >= viewport.top_line + viewport.rows)
+        {
+          viewport.top_line = cursor_line - viewport.rows + 1;
+          content_dirty = 1;
+        }
+
+      size_t cursor_column = display_column (&column_cache, &buffer,
+                                             &line_index, cursor_line, x);
+      if (cursor_column < viewport.left_col)
+        {
+          viewport.left_col = cursor_column;
+          content_dirty = 1;
+        }
+      else if (cursor_column >= viewport.left_col + viewport.cols)
         {
-          char c = input[0];
+          viewport.left_col = cursor_column - viewport.cols + 1;
+          content_dirty = 1;
+        }
+
+      /* A pure vertical scroll shifts the terminal and the front grid
+       * together in one constant-size sequence, so the flush below
+       * only repaints the newly exposed lines.
+       */
+      if (terminal->scroll_region &&
+          viewport.top_line != flushed_top_line &&
+          viewport.left_col == flushed_left_col)
+        {
+          long delta = (long) viewport.top_line - (long) flushed_top_line;
 
-          if (c >= ' ' && c <= '~')
+          if (delta > -(long) viewport.rows && delta < (long) viewport.rows)
             {
-              write (1, input, 1);
-              x++;
-              write (1, STR ("\e[C"));
+              screen_scroll (&screen, &out, (int) delta);
             }
-          else
+        }
+
+      if (content_dirty)
+        {
+          render_viewport (&viewport, &buffer, &line_index, &highlight,
+                           &screen);
+          content_dirty = 0;
+        }
+
+      status_update (&status, current_document, document_count,
+                     documents[current_document].path,
+                     window_size.ws_col, window_size.ws_row,
+                     cursor_line + 1, x + 1);
+
+      // Only a changed status touches the bottom row of the back grid.
+      if (status.dirty || hud_enabled || !screen.valid)
+        {
+          RowWriter status_row;
+          status_row.cells = screen.back + (size_t) viewport.rows * screen.cols;
+          status_row.pos = 0;
+          status_row.left = 0;
+          status_row.cols = screen.cols;
+          status_row.col = 0;
+          status_row.attr = CELL_ATTR_STATUS;
+          row_put (&status_row, status.document_text,
+                   strlen (status.document_text));
+          row_put (&status_row, status.geometry_text,
+                   strlen (status.geometry_text));
+          row_put (&status_row, status.cursor_text,
+                   strlen (status.cursor_text));
+          row_put (&status_row, status.message_text,
+                   strlen (status.message_text));
+
+          if (hud_enabled)
+            {
+              // The previous frame's numbers - this one isn't flushed yet.
+              char *hud = (char *) arena_alloc (&frame_arena, 160);
+              sprintf (hud, " [render %.2f flush %.2f proc %.2f wait %.0f ms; "
+                       "%lu B/%lu writes]",
+                       frame_stats.render_seconds * 1e3,
+                       frame_stats.flush_seconds * 1e3,
+                       frame_stats.input_process_seconds * 1e3,
+                       frame_stats.input_wait_seconds * 1e3,
+                       frame_stats.bytes_written,
+                       frame_stats.write_calls);
+              row_put (&status_row, hud, strlen (hud));
+            }
+
+          while (status_row.col < status_row.cols)
+            {
+              row_put_char (&status_row, '-');
+            }
+
+          status.dirty = 0;
+        }
+
+      frame_stats.render_seconds = now_seconds () - phase_start;
+      phase_start = now_seconds ();
+
+      screen_flush (&screen, &out);
+
+      size_t cursor_col = cursor_column - viewport.left_col;
+      out_append (&out, STR ("\e[0m"));
+      screen_emit_address (&screen, &out,
+                           cursor_line - viewport.top_line, cursor_col);
+      out_flush (&out);
+
+      flushed_top_line = viewport.top_line;
+      flushed_left_col = viewport.left_col;
+
+      frame_stats.flush_seconds = now_seconds () - phase_start;
+      frame_stats.bytes_written = out_total_bytes - frame_bytes_base;
+      frame_stats.write_calls = out_total_writes - frame_writes_base;
+
+      // The input times are from the previous drain; render and flush
+      // are this frame's.  Consumers line records up by one where it
+      // matters.
+      trace_frame (trace_fd, &frame_stats);
+
+      /* While a load is streaming in, feed the buffer between
+       * keystrokes instead of blocking on input, updating the line
+       * index and highlight contexts for the appended tail only.
+       */
+      if (loader.active)
+        {
+          struct pollfd poll_stdin;
+          poll_stdin.fd = 0;
+          poll_stdin.events = POLLIN;
+
+          if (poll (&poll_stdin, 1, 0) <= 0)
             {
-              switch (c)
+              size_t append_offset = buffer.used - 1;
+              size_t old_count = line_index.count;
+              size_t appended = loader_step (&loader, &buffer);
+
+              if (appended)
                 {
-                case '\n':
-                  {
-                    x = 0;
-                    ++y;
-                    write (1, STR ("\e[C"));
-                    break;
-                  }
-                case 0x7f: // DEL (<backspace>)
-                  {
-                    if (x > 0)
-                      {
-                        --x;
-                        write (1, STR ("\e[D"));
-                        write (1, " ", 1);
-                      }
-                    else if (y > 0)
-                      {
-                        --y;
-                        write (1, STR ("\e[F"));
-                      }
-                    break;
-                  }
-                case 'Q' - '@':
-                case '\e': {keep_running = 0;} break;
+                  line_index_insert (&line_index, &buffer,
+                                     append_offset, appended);
+                  highlight_state_insert_lines (&highlight, old_count,
+                                                line_index.count - old_count);
+                  size_t first_line =
+                    line_index_find (&line_index, append_offset);
+                  highlight_update (&highlight, &buffer, &line_index,
+                                    first_line,
+                                    line_index.count - old_count);
+
+                  if (first_line < viewport.top_line + viewport.rows)
+                    {
+                      content_dirty = 1;
+                    }
                 }
+
+              continue;
             }
         }
-      else if (bytes_read == 3 &&
-               input[0] == '\e' &&
-               input[1] == '[')
+
+      /* An unfinished search scans one slice per idle iteration, the
+       * same way the loader streams: only when no input is pending, so
+       * keystrokes stay ahead of the scan.  An edit restarts the scan
+       * since every recorded offset may have shifted.
+       */
+      if (search.active)
         {
-          switch (input[2])
+          if (search.generation != buffer.generation)
+            {
+              search_restart (&search, &buffer);
+            }
+
+          if (!search.done)
+            {
+              struct pollfd poll_stdin;
+              poll_stdin.fd = 0;
+              poll_stdin.events = POLLIN;
+
+              if (poll (&poll_stdin, 1, 0) <= 0)
+                {
+                  search_step (&search, &buffer);
+                  continue;
+                }
+            }
+        }
+
+      // Unsynced autosave deltas hit the disk while the loop is idle,
+      // never between a keystroke and its frame.
+      if (autosave.active && !autosave.synced)
+        {
+          struct pollfd poll_stdin;
+          poll_stdin.fd = 0;
+          poll_stdin.events = POLLIN;
+
+          if (poll (&poll_stdin, 1, 0) <= 0)
+            {
+              autosave_sync (&autosave);
+            }
+        }
+
+      /* A watched file that changed on disk mirrors in from idle
+       * iterations, like the loader and the search.  Only a clean,
+       * fully loaded document follows the disk; local edits park the
+       * events unread.
+       */
+      if (watcher.active && !loader.active &&
+          !documents[current_document].modified)
+        {
+          struct pollfd poll_stdin;
+          poll_stdin.fd = 0;
+          poll_stdin.events = POLLIN;
+
+          if (poll (&poll_stdin, 1, 0) <= 0 && watcher_poll (&watcher))
             {
-            case 'A': // UP
+              if (watcher_reload (documents[current_document].path, &buffer,
+                                  &line_index, &highlight))
+                {
+                  // The file may have shrunk under the cursor.
+                  if (y + x > buffer.used - 1)
+                    {
+                      size_t offset = buffer.used - 1;
+                      size_t line = line_index_find (&line_index, offset);
+                      y = line_index.offsets[line];
+                      x = offset - y;
+                    }
+                  content_dirty = 1;
+                }
+              continue;
+            }
+        }
+
+      /* Drain every pending input chunk before rendering the next
+       * frame: holding an arrow key or pasting a block coalesces into
+       * one repaint instead of one per read().  The first read blocks
+       * until input arrives; after processing a chunk we only read
+       * again if poll says more is already pending.
+       */
+      struct pollfd poll_stdin;
+      poll_stdin.fd = 0;
+      poll_stdin.events = POLLIN;
+
+      b8 drained = 0;
+      r64 input_start = now_seconds ();
+      r64 input_wait = 0;
+
+      while (!drained && keep_running)
+        {
+        char input[64];
+        r64 read_start = now_seconds ();
+
+        // With a watched file, an append must wake the idle editor
+        // too, so wait on both fds before committing to read().
+        if (watcher.active && !documents[current_document].modified)
+          {
+            struct pollfd wait_fds[2];
+            wait_fds[0].fd = 0;
+            wait_fds[0].events = POLLIN;
+            wait_fds[1].fd = watcher.fd;
+            wait_fds[1].events = POLLIN;
+
+            poll (wait_fds, 2, -1);
+            if (!(wait_fds[0].revents & POLLIN))
               {
-                if (y - x > 0)
-                  {
-                    y -= x + 1;
+                input_wait += now_seconds () - read_start;
+                break;
+              }
+          }
+
+        ssize_t bytes_read = read (0, input, 64);
+        input_wait += now_seconds () - read_start;
+        assert (bytes_read != -1);
+        if (bytes_read == 0)  // end of input - nothing will ever arrive
+          {
+            keep_running = 0;
+            break;
+          }
+        /* Bracketed paste.  The terminal wraps a paste in \e[200~ ..
+         * \e[201~; the payload streams into one insert - one undo
+         * record, one re-highlight of the affected lines, one repaint
+         * - instead of a status sprintf and frame per 64-byte chunk.
+         * Throughput is bounded by memcpy, not the keystroke path.
+         */
+        if (bytes_read >= 6 && !memcmp (input, "\e[200~", 6))
+          {
+            size_t paste_size = 4096;
+            size_t paste_used = 0;
+            char *paste = (char *) malloc (paste_size);
+            assert (paste);
 
-                    size_t line_len = 0;
+            size_t consumed = 6;
+            char *terminator = 0;
 
-                    while (y > 0 && buffer.data[y - 1] != '\n')
+            while (keep_running)
+              {
+                size_t pending = bytes_read - consumed;
+
+                if (paste_used + pending > paste_size)
+                  {
+                    while (paste_used + pending > paste_size)
                       {
-                        ++line_len;
-                        --y;
+                        paste_size *= 2;
                       }
+                    paste = (char *) realloc (paste, paste_size);
+                    assert (paste);
+                  }
 
-                    x =
-                      line_len > x ? x : line_len;
+                memcpy (paste + paste_used, input + consumed, pending);
+                paste_used += pending;
 
-                    write (1, STR ("\e[F"));
+                // The terminator can straddle a read boundary, so the
+                // scan backs up over its last five bytes.
+                size_t scan_from = paste_used - pending;
+                scan_from = scan_from > 5 ? scan_from - 5 : 0;
+                terminator = (char *) memmem (paste + scan_from,
+                                              paste_used - scan_from,
+                                              "\e[201~", 6);
+                if (terminator) break;
 
-                    if (x > 0)
-                      {
-                        y += x;
-                        char line_pos_string[65];
-                        s64_to_str (x, line_pos_string);
-                        write (1, STR ("\e["));
-                        write (1, line_pos_string, strlen (line_pos_string));
-                        write (1, "C", 1);
-                      }
+                r64 paste_read_start = now_seconds ();
+                bytes_read = read (0, input, 64);
+                input_wait += now_seconds () - paste_read_start;
+                assert (bytes_read != -1);
+                if (bytes_read == 0)
+                  {
+                    keep_running = 0;
+                    break;
                   }
-              } break;
-            case 'B': // DOWN
+                consumed = 0;
+              }
+
+            if (terminator)
+              {
+                size_t payload_length = terminator - paste;
+
+                if (payload_length)
+                  {
+                    size_t offset = y + x;
+                    if (offset >= buffer.used) offset = buffer.used - 1;
+                    edit_insert (&buffer, &line_index, &highlight,
+                                 offset, paste, payload_length);
+                    undo_record_insert (&undo, offset, paste, payload_length);
+                    autosave_record (&autosave, AUTOSAVE_RECORD_INSERT,
+                                     offset, paste, payload_length);
+                    documents[current_document].modified = 1;
+
+                    size_t landing = offset + payload_length;
+                    size_t line = line_index_find (&line_index, landing);
+                    y = line_index.offsets[line];
+                    x = landing - y;
+                    content_dirty = 1;
+                  }
+
+                // Keys can trail the terminator in the same chunk.
+                size_t leftover = paste_used - payload_length - 6;
+                if (leftover > sizeof (input)) leftover = sizeof (input);
+                memcpy (input, terminator + 6, leftover);
+                bytes_read = leftover;
+              }
+            else
+              {
+                bytes_read = 0;
+              }
+
+            free (paste);
+          }
+
+        /* Only the message segment forms here; the rest of the status
+         * comes from its own caches at paint time.  Every append is
+         * bounded against the remaining space: a full 64-byte read of
+         * non-ASCII input needs 4 characters per byte, more than the
+         * buffer holds.
+         */
+        char message[512];
+        size_t message_used = sprintf (message, "Status: \"");
+
+        for (int i = 0; i < bytes_read; ++i)
+          {
+            // Sign-extending a high-bit char through %x prints
+            // \xffffffNN; format the byte value.
+            u8 byte = input[i];
+            size_t remaining = sizeof (message) - message_used;
+            int appended;
+
+            if (byte >= ' ' && byte <= '~')
+              {
+                appended = snprintf (message + message_used, remaining,
+                                     "%c", byte);
+              }
+            else
+              {
+                appended = snprintf (message + message_used, remaining,
+                                     "\\x%x", byte);
+              }
+
+            if ((size_t) appended >= remaining) break;  // truncated
+            message_used += appended;
+          }
+
+        snprintf (message + message_used, sizeof (message) - message_used,
+                  "\"");
+
+        if (goto_entering)
+          {
+            sprintf (message, "Goto: %.*s", (int) goto_length, goto_text);
+          }
+        else if (search.entering)
+          {
+            sprintf (message, "Search: %s", search.pattern);
+          }
+        else if (search.active)
+          {
+            size_t length = strlen (message);
+            snprintf (message + length, sizeof (message) - length,
+                      "; Search \"%s\": %lu match%s%s",
+                      search.pattern, search.count,
+                      search.count == 1 ? "" : "es",
+                      search.done ? "" : " (scanning)");
+          }
+
+        status_set_message (&status, message);
+
+        /* The chunk is processed byte by byte through one pipeline:
+         * the decoder comes first - mid-sequence bytes belong to it
+         * wherever the read boundary fell - and ground-state bytes
+         * fall through to the prompt, insert and control handling.
+         * Text queued faster than one byte per read() is typed
+         * instead of dropped, and bytes trailing a completed escape
+         * sequence in the same chunk are handled like any others.
+         */
+        for (ssize_t i = 0; i < bytes_read && keep_running; ++i)
+          {
+            char c = input[i];
+
+            if (escape.state != ESCAPE_STATE_GROUND || c == '\e')
               {
-                size_t pos = y;
-                while (buffer.data[pos] && buffer.data[pos] != '\n')
+                u8 key = escape_decode (&escape, c);
+
+                /* A chunk ending right after \e is either a bare
+                 * Escape press or a sequence the read boundary split.
+                 * A short poll settles it: more bytes already on the
+                 * way mean a sequence, silence means the key.
+                 */
+                if (escape.state == ESCAPE_STATE_ESC &&
+                    i + 1 == bytes_read &&
+                    poll (&poll_stdin, 1, ESCAPE_LONE_TIMEOUT_MS) <= 0)
                   {
-                    ++pos;
+                    escape.state = ESCAPE_STATE_GROUND;
+                    key = KEY_ESCAPE;
                   }
 
-                if (buffer.data[pos])
+                switch (key)
+                  {
+                  case KEY_UP:
+                    {
+                      size_t line = line_index_find (&line_index, y);
+
+                      if (line > 0)
+                        {
+                          size_t line_len =
+                            line_index_line_length (&line_index, &buffer,
+                                                    line - 1);
+
+                          y = line_index.offsets[line - 1];
+                          x = line_len > x ? x : line_len;
+                          while (x > 0 && x < line_len &&
+                                 is_utf8_continuation (
+                                   buffer_char_at (&buffer, y + x)))
+                            {
+                              --x;
+                            }
+                        }
+                    } break;
+                  case KEY_DOWN:
+                    {
+                      size_t line = line_index_find (&line_index, y);
+
+                      if (line + 1 < line_index.count)
+                        {
+                          size_t line_len =
+                            line_index_line_length (&line_index, &buffer,
+                                                    line + 1);
+
+                          y = line_index.offsets[line + 1];
+                          x = line_len > x ? x : line_len;
+                          while (x > 0 && x < line_len &&
+                                 is_utf8_continuation (
+                                   buffer_char_at (&buffer, y + x)))
+                            {
+                              --x;
+                            }
+                        }
+                    } break;
+                  case KEY_RIGHT:
+                    {
+                      size_t line = line_index_find (&line_index, y);
+                      size_t line_length =
+                        line_index_line_length (&line_index, &buffer, line);
+
+                      if (x < line_length)
+                        {
+                          do
+                            {
+                              x++;
+                            }
+                          while (x < line_length &&
+                                 is_utf8_continuation (
+                                   buffer_char_at (&buffer, y + x)));
+                        }
+                    } break;
+                  case KEY_LEFT:
+                    {
+                      if (x > 0)
+                        {
+                          do
+                            {
+                              --x;
+                            }
+                          while (x > 0 &&
+                                 is_utf8_continuation (
+                                   buffer_char_at (&buffer, y + x)));
+                        }
+                    } break;
+                  case KEY_HOME:
+                    {
+                      x = 0;
+                    } break;
+                  case KEY_END:
+                    {
+                      size_t line = line_index_find (&line_index, y);
+                      x = line_index_line_length (&line_index, &buffer, line);
+                    } break;
+                  case KEY_PAGE_UP:
+                  case KEY_PAGE_DOWN:
+                    {
+                      size_t line = line_index_find (&line_index, y);
+                      size_t target;
+
+                      if (key == KEY_PAGE_UP)
+                        {
+                          target = line > viewport.rows
+                                 ? line - viewport.rows : 0;
+                        }
+                      else
+                        {
+                          target = line + viewport.rows;
+                          if (target >= line_index.count)
+                            {
+                              target = line_index.count - 1;
+                            }
+                        }
+
+                      size_t line_len =
+                        line_index_line_length (&line_index, &buffer, target);
+
+                      y = line_index.offsets[target];
+                      x = line_len > x ? x : line_len;
+                      while (x > 0 && x < line_len &&
+                             is_utf8_continuation (
+                               buffer_char_at (&buffer, y + x)))
+                        {
+                          --x;
+                        }
+                    } break;
+                  case KEY_DELETE:
+                    {
+                      size_t line = line_index_find (&line_index, y);
+                      size_t line_length =
+                        line_index_line_length (&line_index, &buffer, line);
+
+                      /* Forward delete of the whole character under
+                       * the cursor, the mirror of backspace.  The
+                       * walk stops at the UTF-8 maximum of four
+                       * bytes - binary data runs continuation bytes
+                       * far longer than any character, and those peel
+                       * off in pieces.
+                       */
+                      if (x < line_length)
+                        {
+                          size_t char_length = 1;
+                          while (char_length < 4 &&
+                                 x + char_length < line_length &&
+                                 is_utf8_continuation (
+                                   buffer_char_at (&buffer,
+                                                   y + x + char_length)))
+                            {
+                              ++char_length;
+                            }
+
+                          char removed[4];
+                          for (size_t j = 0; j < char_length; ++j)
+                            {
+                              removed[j] = buffer_char_at (&buffer,
+                                                           y + x + j);
+                            }
+                          undo_record_delete (&undo, y + x, removed,
+                                              char_length);
+                          autosave_record (&autosave,
+                                           AUTOSAVE_RECORD_DELETE,
+                                           y + x, 0, char_length);
+                          edit_delete (&buffer, &line_index, &highlight,
+                                       y + x, char_length);
+                          documents[current_document].modified = 1;
+                          content_dirty = 1;
+                        }
+                    } break;
+                  case KEY_ESCAPE:
+                    {
+                      if (goto_entering)
+                        {
+                          goto_entering = 0;
+                          status_set_message (&status, "");
+                        }
+                      else if (search.entering)
+                        {
+                          search.entering = 0;
+                          search.active = 0;
+                        }
+                      else
+                        {
+                          keep_running = 0;
+                        }
+                    } break;
+                  default: break;  // decoded but unbound - swallowed
+                  }
+              }
+            else if (goto_entering)
+              {
+                if (c == '\n')
                   {
-                    y = pos + 1;
+                    goto_entering = 0;
+                    goto_text[goto_length] = 0;
 
-                    for (size_t line_pos = 0;
-                         line_pos < x;
-                         ++line_pos)
+                    if (goto_length)
                       {
-                        if (!buffer.data[y] || buffer.data[y] == '\n')
+                        size_t line;
+
+                        if (goto_text[0] == '$')
                           {
-                            x = line_pos;
-                            break;
+                            line = line_index.count - 1;
                           }
-                        ++y;
+                        else
+                          {
+                            size_t value = strtoul (goto_text, 0, 10);
+
+                            if (goto_text[goto_length - 1] == '%')
+                              {
+                                if (value > 100) value = 100;
+                                line = (line_index.count - 1) * value / 100;
+                              }
+                            else
+                              {
+                                // 1-based, like the status line shows.
+                                line = value ? value - 1 : 0;
+                              }
+                          }
+
+                        if (line >= line_index.count)
+                          {
+                            line = line_index.count - 1;
+                          }
+
+                        y = line_index.offsets[line];
+                        x = 0;
+
+                        // Fault the target region in before the paint.
+                        buffer_readahead (&buffer, y, 1u << 20);
                       }
 
-                    write (1, STR ("\e[E"));
+                    status_set_message (&status, "");
+                  }
+                else if (c == 0x7f)
+                  {
+                    if (goto_length) --goto_length;
+                  }
+                else if (goto_length + 1 < sizeof (goto_text) &&
+                         ((c >= '0' && c <= '9') || c == '%' || c == '$'))
+                  {
+                    goto_text[goto_length++] = c;
+                  }
 
-                    if (x > 0)
+                if (goto_entering)
+                  {
+                    char prompt[40];
+                    sprintf (prompt, "Goto: %.*s", (int) goto_length, goto_text);
+                    status_set_message (&status, prompt);
+                  }
+              }
+            else if (search.entering)
+              {
+                if (c == '\n')
+                  {
+                    search.entering = 0;
+                    size_t offset = search_next (&search, y + x);
+                    if (offset != (size_t) -1)
                       {
-                        char line_pos_string[65];
-                        s64_to_str (x, line_pos_string);
-                        write (1, STR ("\e["));
-                        write (1, line_pos_string, strlen (line_pos_string));
-                        write (1, "C", 1);
+                        size_t line = line_index_find (&line_index, offset);
+                        y = line_index.offsets[line];
+                        x = offset - y;
                       }
                   }
-              } break;
-            case 'C': // RIGHT
+                else if (c == 0x7f)
+                  {
+                    if (search.pattern_length > 0)
+                      {
+                        search.pattern[--search.pattern_length] = 0;
+                        search_restart (&search, &buffer);
+                      }
+                  }
+                else if (c >= ' ' && c <= '~' &&
+                         search.pattern_length + 1 < SEARCH_PATTERN_MAX)
+                  {
+                    search.pattern[search.pattern_length++] = c;
+                    search.pattern[search.pattern_length] = 0;
+                    search_restart (&search, &buffer);
+                  }
+
+                if (search.entering)
+                  {
+                    char prompt[SEARCH_PATTERN_MAX + 16];
+                    sprintf (prompt, "Search: %s", search.pattern);
+                    status_set_message (&status, prompt);
+                  }
+              }
+            else
               {
-                // if (buffer.data[y] && buffer.data[y] != '\n')
+                if (c >= ' ' && c <= '~')
                   {
+                    size_t offset = y + x;
+                    if (offset >= buffer.used) offset = buffer.used - 1;
+                    edit_insert (&buffer, &line_index, &highlight, offset, &c, 1);
+                    undo_record_insert (&undo, offset, &c, 1);
+                    autosave_record (&autosave, AUTOSAVE_RECORD_INSERT,
+                                     offset, &c, 1);
+                    documents[current_document].modified = 1;
                     x++;
-                    // y++;
-                    write (1, STR ("\e[C"));
+                    content_dirty = 1;
                   }
-              } break;
-            case 'D': // LEFT
-              {
-                if (x > 0)
+                else if (c & 0x80)
                   {
-                    --x;
-                    // --y;
-                    write (1, STR ("\e[D"));
+                    /* A multibyte character decodes right out of the
+                     * chunk.  Only a complete valid sequence inserts, and
+                     * as a single edit, so undo and the journal never
+                     * split a character; stray or truncated bytes fall
+                     * out of the pipeline one at a time.
+                     */
+                    u32 codepoint;
+                    size_t length = utf8_decode (input + i, input + bytes_read,
+                                                 &codepoint);
+                    if (codepoint != UTF8_REPLACEMENT)
+                      {
+                        size_t offset = y + x;
+                        if (offset >= buffer.used) offset = buffer.used - 1;
+                        edit_insert (&buffer, &line_index, &highlight,
+                                     offset, input + i, length);
+                        undo_record_insert (&undo, offset, input + i, length);
+                        autosave_record (&autosave, AUTOSAVE_RECORD_INSERT,
+                                         offset, input + i, length);
+                        documents[current_document].modified = 1;
+                        x += length;
+                        content_dirty = 1;
+                        i += length - 1;
+                      }
                   }
-              } break;
-            default: assert (!"Unhandled escape key input");
-            }
+                else
+                  {
+                    switch (c)
+                      {
+                      case '\n':
+                        {
+                          size_t offset = y + x;
+                          if (offset >= buffer.used) offset = buffer.used - 1;
+                          edit_insert (&buffer, &line_index, &highlight,
+                                       offset, &c, 1);
+                          undo_record_insert (&undo, offset, &c, 1);
+                          autosave_record (&autosave, AUTOSAVE_RECORD_INSERT,
+                                           offset, &c, 1);
+                          documents[current_document].modified = 1;
+                          x = 0;
+                          y = offset + 1;
+                          content_dirty = 1;
+                          break;
+                        }
+                      case 0x7f: // DEL (<backspace>)
+                        {
+                          if (x > 0)
+                            {
+                              /* Step back over a whole character -
+                               * at most the UTF-8 maximum of four
+                               * bytes, so a run of stray continuation
+                               * bytes peels off in pieces instead of
+                               * overrunning removed[].
+                               */
+                              size_t char_end = x;
+                              do
+                                {
+                                  --x;
+                                }
+                              while (x > 0 && char_end - x < 4 &&
+                                     is_utf8_continuation (buffer_char_at (&buffer,
+                                                                           y + x)));
+                              size_t char_length = char_end - x;
+
+                              if (y + char_end < buffer.used)
+                                {
+                                  char removed[4];
+                                  for (size_t j = 0; j < char_length; ++j)
+                                    {
+                                      removed[j] = buffer_char_at (&buffer,
+                                                                   y + x + j);
+                                    }
+                                  undo_record_delete (&undo, y + x, removed,
+                                                      char_length);
+                                  autosave_record (&autosave,
+                                                   AUTOSAVE_RECORD_DELETE,
+                                                   y + x, 0, char_length);
+                                  edit_delete (&buffer, &line_index, &highlight,
+                                               y + x, char_length);
+                                  documents[current_document].modified = 1;
+                                  content_dirty = 1;
+                                }
+                            }
+                          else if (y > 0)
+                            {
+                              size_t line = line_index_find (&line_index, y);
+                              y = line_index.offsets[line - 1];
+                              x = line_index_line_length (&line_index, &buffer, line - 1);
+                            }
+                          break;
+                        }
+                      case 'B' - '@': // next document, wrapping
+                        {
+                          if (document_count > 1)
+                            {
+                              Document *old = &documents[current_document];
+                              old->buffer = buffer;
+                              old->loader = loader;
+                              old->line_index = line_index;
+                              old->highlight = highlight;
+                              old->undo = undo;
+                              old->autosave = autosave;
+                              old->watch = watcher;
+                              old->x = x;
+                              old->y = y;
+                              old->top_line = viewport.top_line;
+                              old->left_col = viewport.left_col;
+
+                              current_document =
+                                (current_document + 1) % document_count;
+                              Document *next = &documents[current_document];
+
+                              if (!next->loaded)
+                                {
+                                  documents_evict (documents, document_count,
+                                                   current_document);
+                                  document_realize (next);
+                                }
+                              next->last_viewed = ++view_tick;
+
+                              buffer = next->buffer;
+                              loader = next->loader;
+                              line_index = next->line_index;
+                              highlight = next->highlight;
+                              undo = next->undo;
+                              autosave = next->autosave;
+                              watcher = next->watch;
+                              x = next->x;
+                              y = next->y;
+                              viewport.top_line = next->top_line;
+                              viewport.left_col = next->left_col;
+
+                              // Recorded offsets belong to the old buffer.
+                              search_restart (&search, &buffer);
+
+                              /* So does the column cache - generation
+                               * alone can't tell documents apart (every
+                               * unedited buffer sits at generation 0).
+                               */
+                              column_cache.line = (size_t) -1;
+                              content_dirty = 1;
+                            }
+                          break;
+                        }
+                      case 'G' - '@': // goto line N / N% / $ (bottom)
+                        {
+                          goto_entering = 1;
+                          goto_length = 0;
+                          status_set_message (&status, "Goto: ");
+                          break;
+                        }
+                      case 'S' - '@': // search (IXON is off, so ^S is free)
+                        {
+                          search.entering = 1;
+                          search.active = 1;
+                          search.pattern[0] = 0;
+                          search.pattern_length = 0;
+                          search_restart (&search, &buffer);
+                          status_set_message (&status, "Search: ");
+                          break;
+                        }
+                      case 'N' - '@': // next match
+                      case 'P' - '@': // previous match
+                        {
+                          size_t offset = c == 'N' - '@'
+                                        ? search_next (&search, y + x + 1)
+                                        : search_prev (&search, y + x);
+                          if (offset != (size_t) -1)
+                            {
+                              size_t line = line_index_find (&line_index, offset);
+                              y = line_index.offsets[line];
+                              x = offset - y;
+                            }
+                          break;
+                        }
+                      case 'O' - '@': // save in place (see document_save)
+                        {
+                          document_save (documents[current_document].path,
+                                         &buffer, &loader, &autosave);
+                          if (!autosave.dirty)
+                            {
+                              documents[current_document].modified = 0;
+                            }
+                          break;
+                        }
+                      case 'T' - '@': // perf HUD on the status line
+                        {
+                          hud_enabled = !hud_enabled;
+                          break;
+                        }
+                      case 'U' - '@': // undo (^Z would hit ISIG's suspend)
+                        {
+                          UndoRecord *record =
+                            undo.cursor ? &undo.records[undo.cursor - 1] : 0;
+                          size_t offset = undo_apply (&undo, &buffer,
+                                                      &line_index, &highlight);
+                          if (offset != (size_t) -1)
+                            {
+                              // Journal the inverse edit undo just applied.
+                              if (record->kind == UNDO_INSERT)
+                                {
+                                  autosave_record (&autosave,
+                                                   AUTOSAVE_RECORD_DELETE,
+                                                   record->offset, 0,
+                                                   record->length);
+                                }
+                              else
+                                {
+                                  autosave_record (&autosave,
+                                                   AUTOSAVE_RECORD_INSERT,
+                                                   record->offset, record->text,
+                                                   record->length);
+                                }
+                              size_t line = line_index_find (&line_index, offset);
+                              y = line_index.offsets[line];
+                              x = offset - y;
+                              documents[current_document].modified = 1;
+                              content_dirty = 1;
+                            }
+                          break;
+                        }
+                      case 'Y' - '@': // redo
+                        {
+                          UndoRecord *record =
+                            undo.cursor < undo.count
+                              ? &undo.records[undo.cursor] : 0;
+                          size_t offset = redo_apply (&undo, &buffer,
+                                                      &line_index, &highlight);
+                          if (offset != (size_t) -1)
+                            {
+                              autosave_record (&autosave,
+                                               record->kind == UNDO_INSERT
+                                                 ? AUTOSAVE_RECORD_INSERT
+                                                 : AUTOSAVE_RECORD_DELETE,
+                                               record->offset,
+                                               record->text, record->length);
+                              size_t line = line_index_find (&line_index, offset);
+                              y = line_index.offsets[line];
+                              x = offset - y;
+                              documents[current_document].modified = 1;
+                              content_dirty = 1;
+                            }
+                          break;
+                        }
+                      case 'Q' - '@': {keep_running = 0;} break;
+                      }
+                  }
+              }
+          }
+
+          if (poll (&poll_stdin, 1, 0) <= 0) drained = 1;
+        }
+
+      frame_stats.input_wait_seconds = input_wait;
+      frame_stats.input_process_seconds =
+        now_seconds () - input_start - input_wait;
+    }
+
+  out_flush (&out);
+
+  if (trace_fd != -1) close (trace_fd);
+
+  free (screen.front);
+  free (screen.back);
+  free (screen.addresses);
+  free (screen.address_lengths);
+  arena_free (&frame_arena);
+  arena_free (&session_arena);
+
+  documents[current_document].buffer = buffer;
+  documents[current_document].autosave = autosave;
+  documents[current_document].watch = watcher;
+
+  for (size_t i = 0; i < document_count; ++i)
+    {
+      if (documents[i].loaded)
+        {
+          // Unsaved edits stay recoverable: the journal survives.
+          autosave_end (&documents[i].autosave);
+          watcher_end (&documents[i].watch);
+          buffer_free (&documents[i].buffer);
+          arena_free (&documents[i].arena);
         }
     }
 
-  destroy_screen (original_terminal_attributes);
+  free (documents);
+
+  destroy_screen (original_terminal_attributes, terminal);
 
   return 0;
 }
+
+#endif // TTE_BENCH